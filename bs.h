@@ -1,8 +1,33 @@
 typedef struct Store Store;
+typedef struct Bsreq Bsreq;
+typedef struct Bsched Bsched;
+typedef struct Bsrange Bsrange;
+typedef struct Iostats Iostats;
+typedef struct Bcache Bcache;
+typedef struct Snap Snap;
+
+enum {
+	Nlathist	= 24,	/* latency histogram buckets, log2 of microseconds */
+};
+
+/* kept by devbs.c, for the stats file */
+struct Iostats
+{
+	Lock;
+	ulong	ops[2];		/* by iswrite */
+	uvlong	bytes[2];
+	ulong	errors;
+	int	inflight;
+	int	maxinflight;
+	uvlong	busyus;		/* time with requests in flight */
+	uvlong	depthus;	/* sum of inflight over time, for average depth */
+	uvlong	lastus;		/* last change of inflight */
+	ulong	lat[2][Nlathist];	/* bucket i counts latencies below 2^(i+1) us */
+};
 
 struct Store
 {
-	RWlock;				/* devbs rlocks for: rctl,wctl,io,raw.  wlocks for: init,diskinit,modifying values */
+	RWlock;				/* devbs rlocks for: rctl,wctl,raw,flush,discard.  wlocks for: init,diskinit,modifying values.  partition i/o uses Snap */
 	void	*ctlr;
 
 	int	vers;			/* version, increased for each devinit. */
@@ -12,12 +37,21 @@ struct Store
 	uint	alignmask;		/* alignment, bits must be zero */
 	char	*descr;			/* description, from device */
 	char	devtype[KNAMELEN];	/* type of device, returned when reading bsXX/ctl */
+	Store	*owner;			/* store built on this one (raid, crypt, ...), nil if none.  see bsclaim */
+	int	ownerrdonly;		/* whether data and partitions can still be opened for reading */
 
 	/* set by init, used by devbs.c */
 	Part	*parts;			/* first is always "data" for whole disk */
 	int	nparts;
 	vlong	size;
 
+	Bsched	*sched;			/* request scheduler, private to devbs.c */
+	Bcache	*cache;			/* block cache state, private to devbs.c */
+	Snap	*snap;			/* state for the data path, private to devbs.c */
+	Iostats	stats;			/* whole store */
+	Iostats	*pstats;		/* per partition, like parts */
+	int	npstats;
+
 	/* called both when "ready" and not */
 	void	(*init)(Store *d);		/* init controller */
 	void	(*devinit)(Store *d);		/* find disk and set size */
@@ -27,6 +61,61 @@ struct Store
 	/* only called when "ready": */
 	long	(*io)(void *d, int iswrite, void *buf, long n, vlong off);
 	long	(*raw)(Store *d, void *s, long n, vlong off, void **r);
+	void	(*submit)(Store *d, Bsreq *r);	/* optional, start i/o, completes with bsreqdone */
+	void	(*discard)(Store *d, Bsrange *r, int nr);	/* optional, ranges are sorted, aligned and do not touch */
+	void	(*flush)(Store *d);		/* optional, write volatile cache to media */
+};
+
+/* Bsreq.flags */
+enum {
+	Bfua	= 1<<0,		/* write is on media when done, not just in the device cache */
+};
+
+/* byte range on a store */
+struct Bsrange
+{
+	vlong	off;
+	vlong	n;
+};
+
+/*
+ * asynchronous request.  the issuer fills in the first fields and
+ * hands it to bssubmit.  the store calls bsreqdone when the i/o has
+ * finished, possibly from interrupt context.  if complete is set it
+ * is called (from the same context), otherwise sleepers in bswait
+ * are woken up.  the buffer must stay valid until completion.
+ */
+struct Bsreq
+{
+	Rendez;
+	int	iswrite;
+	int	flags;
+	void	*buf;
+	long	n;
+	vlong	off;
+	void	(*complete)(Bsreq *r);	/* nil for bswait */
+	void	*aux;			/* for issuer */
+
+	/* set at completion */
+	int	done;
+	long	r;			/* bytes transferred */
+	char	err[ERRMAX];		/* empty on success */
+
+	/* for store */
+	int	npending;
+	Bsreq	*next;
 };
 
-void blockstoreadd(Store *);
+void	blockstoreadd(Store *);
+void	blockstoreready(Store *);
+void	blockstorearrive(Store *);
+void	blockstoregone(Store *);
+Store*	blockstorelookup(char *name);
+void	bscacheflush(Store *d);
+void	bsclaim(Store *d, Store *owner, int rdonly);
+void	bsunclaim(Store *d);
+void	bspost(Store *d, char *fmt, ...);
+void	bssubmit(Store *d, Bsreq *r);
+long	bswait(Bsreq *r);
+void	bsreqdone(Bsreq *r, long n, char *err);
+long	bsbounceio(long (*io)(void*, int, void*, long, vlong), void *d, int iswrite, void *buf, long n, vlong off);
@@ -80,6 +80,29 @@ fastticks(uvlong *hz)
 	return m->ticks;
 }
 
+/*
+ * microseconds since clockinit, from the ticks and the timer counting
+ * down to the next tick.  an expired timer whose interrupt is still
+ * pending would make time go back, never return less than before.
+ */
+uvlong
+clockus(void)
+{
+	static uvlong last;
+	uvlong us;
+	ulong v;
+	int s;
+
+	s = splhi();
+	v = TIMERREG->timer0;
+	us = (uvlong)m->ticks*(1000000/HZ) + (CLOCKFREQ/HZ-v)/(CLOCKFREQ/1000000);
+	if(us < last)
+		us = last;
+	last = us;
+	splx(s);
+	return us;
+}
+
 void
 microdelay(int l)
 {
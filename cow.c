@@ -0,0 +1,705 @@
+/*
+ * copy-on-write overlay stores, for point-in-time images of a live
+ * store.  bs40 and up.  configured through their devctl file:
+ *	echo create bs01 bs02 format >/dev/bs40/devctl
+ * bs40 then has the contents of bs01 (the base), and is used instead
+ * of it.  "format" initialises bs02 (the delta), whatever was on it
+ * is lost; later creates leave it out.  "snap" freezes the base: from
+ * then on, each 64k chunk written through bs40 is first copied to the
+ * delta, and writes and reads of that chunk go to the delta.  the
+ * base can be read for a backup while bs40 stays in use, it can only
+ * be opened for reading.  bs02 cannot be opened at all.  the
+ * filesystem should be synced before "snap", the cache of bs40 is
+ * written by it.
+ *
+ * "delete" (or "merge") ends the snapshot and keeps the live data:
+ * the chunks in the delta are copied back to the base, in a
+ * background process.  "revert" ends it by dropping the delta, bs40
+ * goes back to the frozen image and the writes since "snap" are lost.
+ *
+ * the delta starts with a header and a table of the base chunk of
+ * each delta chunk, tagged with the generation of the snapshot.
+ * snap and revert only write a new generation to the header, old
+ * entries are ignored.  the table is kept in memory, and read when
+ * the store is created again after boot, with the same base.
+ */
+
+#include	"u.h"
+#include	"../port/lib.h"
+#include	"mem.h"
+#include	"dat.h"
+#include	"fns.h"
+#include	"../port/error.h"
+#include	"part.h"
+#include	"bs.h"
+
+typedef struct Cow Cow;
+
+#define Unmapped	(~0UL)	/* free slot, or no slot for a chunk */
+
+enum {
+	Ncow		= 2,
+	Firstnum	= 40,		/* Store.num of first overlay */
+	Chunk		= 64*1024,	/* unit of copy-on-write */
+	Tblk		= 4*1024,	/* header and table block */
+	Entsize		= 8,		/* table entry: generation, base chunk */
+	Entperblk	= Tblk/Entsize,
+
+	/* Cow.state, kept in header */
+	Snone		= 0,
+	Sactive,
+	Smerging,
+};
+
+static char *states[] = {
+[Snone]		"none",
+[Sactive]	"active",
+[Smerging]	"merging",
+};
+
+static char Magic[8] = "cowsnap1";
+
+struct Cow
+{
+	QLock;			/* for map, header, table, cbuf and configuration */
+	RWlock	rw;		/* rlocked by i/o, wlocked for merging a chunk or changing state */
+	Store	*d;
+	Store	*base;		/* nil when not created */
+	Store	*delta;
+	int	state;
+	ulong	gen;		/* of current snapshot */
+
+	ulong	nslots;		/* chunks on delta */
+	vlong	doff;		/* offset of first chunk on delta */
+	ulong	nused;		/* slots allocated in this generation */
+	ulong	nmapped;
+	ulong	*tab;		/* base chunk of each slot, or Unmapped */
+	ulong	*next;		/* hash chain, by slot */
+	ulong	*hash;		/* first slot, by base chunk */
+	ulong	nhash;
+
+	uchar	*cbase;
+	uchar	*cbuf;		/* one chunk */
+	uchar	*tbuf;		/* one header or table block */
+
+	int	merging;	/* mergeproc running */
+	ulong	mergeslot;
+	int	full;
+
+	ulong	ncopyup;
+	ulong	nmerged;
+	ulong	ndelta;		/* chunk i/o to delta */
+	ulong	nbase;		/* chunk i/o to base */
+};
+
+static Cow cows[Ncow];
+static Store stores[Ncow];
+
+static char Enocow[] = "overlay not created";
+static char Efull[] = "snapshot delta full";
+
+static ulong
+g32(uchar *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+static void
+p32(uchar *p, ulong v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+	p[2] = v>>16;
+	p[3] = v>>24;
+}
+
+static void
+backio(Store *s, int iswrite, void *buf, long n, vlong off)
+{
+	Bsreq r;
+
+	memset(&r, 0, sizeof r);
+	r.iswrite = iswrite;
+	r.buf = buf;
+	r.n = n;
+	r.off = off;
+	bssubmit(s, &r);
+	if(bswait(&r) != n)
+		error(iswrite ? "short write" : "short read");
+}
+
+/* bytes in base chunk ch, the last may be short */
+static long
+chunksize(Cow *c, ulong ch)
+{
+	vlong n;
+
+	n = c->base->size - (vlong)ch*Chunk;
+	if(n > Chunk)
+		n = Chunk;
+	return n;
+}
+
+static ulong
+lookup(Cow *c, ulong ch)
+{
+	ulong s;
+
+	for(s = c->hash[ch%c->nhash]; s != Unmapped; s = c->next[s])
+		if(c->tab[s] == ch)
+			return s;
+	return Unmapped;
+}
+
+static void
+map(Cow *c, ulong s, ulong ch)
+{
+	c->tab[s] = ch;
+	c->next[s] = c->hash[ch%c->nhash];
+	c->hash[ch%c->nhash] = s;
+	c->nmapped++;
+}
+
+static void
+unmap(Cow *c, ulong s)
+{
+	ulong *l;
+
+	for(l = &c->hash[c->tab[s]%c->nhash]; *l != s; l = &c->next[*l])
+		;
+	*l = c->next[s];
+	c->tab[s] = Unmapped;
+	c->nmapped--;
+}
+
+static void
+mapreset(Cow *c)
+{
+	memset(c->hash, 0xff, c->nhash*sizeof c->hash[0]);
+	memset(c->tab, 0xff, c->nslots*sizeof c->tab[0]);
+	c->nused = 0;
+	c->nmapped = 0;
+}
+
+/* the caller sets c->gen and c->state when the write succeeded */
+static void
+hdrwrite(Cow *c, ulong gen, int state)
+{
+	memset(c->tbuf, 0, Tblk);
+	memmove(c->tbuf, Magic, sizeof Magic);
+	p32(c->tbuf+8, gen);
+	p32(c->tbuf+12, state);
+	p32(c->tbuf+16, Chunk);
+	p32(c->tbuf+20, c->nslots);
+	backio(c->delta, 1, c->tbuf, Tblk, 0);
+}
+
+/* write the table block with the entry of slot s */
+static void
+tblkwrite(Cow *c, ulong s)
+{
+	ulong i, b;
+	uchar *p;
+
+	b = s/Entperblk;
+	memset(c->tbuf, 0, Tblk);
+	for(i = 0; i < Entperblk; i++) {
+		s = b*Entperblk+i;
+		if(s >= c->nused)
+			break;
+		p = c->tbuf+i*Entsize;
+		p32(p, c->gen);
+		p32(p+4, c->tab[s]);
+	}
+	backio(c->delta, 1, c->tbuf, Tblk, Tblk+(vlong)b*Tblk);
+}
+
+/* read header and table of the current generation.  with fmt, initialise the delta. */
+static void
+load(Cow *c, int fmt)
+{
+	ulong b, i, s, ch, nch;
+	uchar *p;
+
+	mapreset(c);
+	backio(c->delta, 0, c->tbuf, Tblk, 0);
+	if(memcmp(c->tbuf, Magic, sizeof Magic) != 0 || fmt) {
+		if(!fmt)
+			error("delta not initialised, use format");
+		if(memcmp(c->tbuf, Magic, sizeof Magic) == 0 && g32(c->tbuf+12) != Snone)
+			error("delta holds a snapshot");
+		hdrwrite(c, 1, Snone);
+		c->gen = 1;
+		c->state = Snone;
+		return;
+	}
+	if(g32(c->tbuf+16) != Chunk || g32(c->tbuf+20) != c->nslots)
+		error("delta has different layout");
+	c->gen = g32(c->tbuf+8);
+	c->state = g32(c->tbuf+12);
+	if(c->state > Smerging)
+		error("bad state in delta header");
+	if(c->state == Snone)
+		return;
+
+	nch = (c->base->size+Chunk-1)/Chunk;
+	for(b = 0; b*Entperblk < c->nslots; b++) {
+		backio(c->delta, 0, c->tbuf, Tblk, Tblk+(vlong)b*Tblk);
+		for(i = 0; i < Entperblk; i++) {
+			s = b*Entperblk+i;
+			if(s >= c->nslots)
+				break;
+			p = c->tbuf+i*Entsize;
+			if(g32(p) != c->gen)
+				continue;
+			c->nused = s+1;
+			ch = g32(p+4);
+			if(ch == Unmapped)
+				continue;
+			if(ch >= nch || lookup(c, ch) != Unmapped)
+				error("bad entry in delta table");
+			map(c, s, ch);
+		}
+	}
+}
+
+/* first write to chunk ch in this snapshot.  called with c qlocked. */
+static void
+copyup(Cow *c, ulong ch, uchar *p, long n, vlong off)
+{
+	ulong s;
+	long cs;
+
+	if(c->nused == c->nslots) {
+		if(!c->full) {
+			c->full = 1;
+			print("%s: %s\n", c->d->name, Efull);
+			bspost(c->d, "error %s %q\n", c->d->name, Efull);
+		}
+		error(Efull);
+	}
+	s = c->nused;
+	cs = chunksize(c, ch);
+	if(n < cs)
+		backio(c->base, 0, c->cbuf, cs, (vlong)ch*Chunk);
+	memmove(c->cbuf+off%Chunk, p, n);
+	backio(c->delta, 1, c->cbuf, cs, c->doff+(vlong)s*Chunk);
+
+	c->nused++;
+	map(c, s, ch);
+	if(waserror()) {
+		unmap(c, s);
+		c->nused--;
+		nexterror();
+	}
+	tblkwrite(c, s);
+	poperror();
+	c->ncopyup++;
+}
+
+/* i/o within chunk ch.  called with c->rw rlocked. */
+static void
+chunkio(Cow *c, int iswrite, uchar *p, long n, vlong off)
+{
+	ulong ch, s;
+
+	ch = off/Chunk;
+	qlock(c);
+	s = lookup(c, ch);
+	if(iswrite && s == Unmapped && c->state == Sactive) {
+		if(waserror()) {
+			qunlock(c);
+			nexterror();
+		}
+		copyup(c, ch, p, n, off);
+		poperror();
+		qunlock(c);
+		return;
+	}
+	if(s == Unmapped)
+		c->nbase++;
+	else
+		c->ndelta++;
+	qunlock(c);
+
+	/* the slot cannot change while rw is rlocked */
+	if(s == Unmapped)
+		backio(c->base, iswrite, p, n, off);
+	else
+		backio(c->delta, iswrite, p, n, c->doff+(vlong)s*Chunk+off%Chunk);
+}
+
+static long
+cowio(void *a, int iswrite, void *buf, long n, vlong off)
+{
+	Store *d;
+	Cow *c;
+	uchar *p;
+	long h, m;
+
+	d = a;
+	c = d->ctlr;
+	if(c->base == nil)
+		error(Enocow);
+	if(off < 0 || off > d->size)
+		error(Ebadarg);
+	if(n > d->size-off)
+		n = d->size-off;
+
+	p = buf;
+	rlock(&c->rw);
+	if(waserror()) {
+		runlock(&c->rw);
+		nexterror();
+	}
+	for(h = 0; h < n; h += m) {
+		m = Chunk - (off+h)%Chunk;
+		if(m > n-h)
+			m = n-h;
+		chunkio(c, iswrite, p+h, m, off+h);
+	}
+	poperror();
+	runlock(&c->rw);
+	return n;
+}
+
+/* copy slot s back to the base.  called with c->rw wlocked and c qlocked. */
+static void
+mergechunk(Cow *c, ulong s)
+{
+	ulong ch;
+	long cs;
+
+	ch = c->tab[s];
+	cs = chunksize(c, ch);
+	backio(c->delta, 0, c->cbuf, cs, c->doff+(vlong)s*Chunk);
+	backio(c->base, 1, c->cbuf, cs, (vlong)ch*Chunk);
+	unmap(c, s);
+	if(waserror()) {
+		map(c, s, ch);
+		nexterror();
+	}
+	tblkwrite(c, s);
+	poperror();
+	c->nmerged++;
+}
+
+static void
+mergeproc(void *a)
+{
+	Cow *c;
+	ulong s;
+	int done;
+
+	c = a;
+	if(waserror()) {
+		print("%s: merge: %s\n", c->d->name, up->env->errstr);
+		bspost(c->d, "error %s %q\n", c->d->name, up->env->errstr);
+		c->merging = 0;
+		return;
+	}
+	done = 0;
+	for(s = 0; !done; s++) {
+		wlock(&c->rw);
+		qlock(c);
+		if(waserror()) {
+			qunlock(c);
+			wunlock(&c->rw);
+			nexterror();
+		}
+		if(s < c->nused) {
+			if(c->tab[s] != Unmapped)
+				mergechunk(c, s);
+			c->mergeslot = s+1;
+		} else {
+			hdrwrite(c, c->gen+1, Snone);
+			c->gen++;
+			c->state = Snone;
+			mapreset(c);
+			c->full = 0;
+			done = 1;
+		}
+		poperror();
+		qunlock(c);
+		wunlock(&c->rw);
+	}
+	print("%s: merged into %s\n", c->d->name, c->base->name);
+	c->merging = 0;
+	poperror();
+}
+
+/* called with c qlocked */
+static void
+merge(Cow *c)
+{
+	char name[KNAMELEN];
+
+	if(c->merging)
+		return;
+	if(c->state != Smerging) {
+		hdrwrite(c, c->gen, Smerging);
+		c->state = Smerging;
+	}
+	c->merging = 1;
+	c->mergeslot = 0;
+	snprint(name, sizeof name, "%smerge", c->d->name);
+	kproc(name, mergeproc, c, 0);
+}
+
+static Store*
+store(Cow *c, char *name)
+{
+	Store *s;
+
+	s = blockstorelookup(name);
+	if(s == nil)
+		error("no such store");
+	if(s == c->d)
+		error("store cannot be on itself");
+	if(s->ready == 0)
+		error("store not ready");
+	if(s->alignmask >= Tblk)
+		error("store alignment too large");
+	return s;
+}
+
+static void
+cowfree(Cow *c)
+{
+	free(c->cbase);
+	free(c->tab);
+	free(c->next);
+	free(c->hash);
+	c->cbase = nil;
+	c->tab = c->next = c->hash = nil;
+}
+
+/* "create base delta [format]" */
+static void
+cowcreate(Cow *c, Cmdbuf *cb)
+{
+	Store *base, *delta;
+	vlong tsize;
+
+	if(c->base != nil)
+		error("already created");
+	if(cb->nf == 4 && strcmp(cb->f[3], "format") != 0)
+		error(Ebadarg);
+	base = store(c, cb->f[1]);
+	delta = store(c, cb->f[2]);
+	if(base == delta)
+		error("base and delta are the same store");
+
+	/* the base stays readable, for backups of the snapshot */
+	bsclaim(base, c->d, 1);
+	if(waserror()) {
+		bsunclaim(base);
+		nexterror();
+	}
+	bsclaim(delta, c->d, 0);
+	if(waserror()) {
+		bsunclaim(delta);
+		nexterror();
+	}
+
+	/* header, table, chunks */
+	c->nslots = (delta->size-Tblk)/(Chunk+Entsize);
+	tsize = ROUND((vlong)c->nslots*Entsize, Tblk);
+	if(Tblk+tsize+(vlong)c->nslots*Chunk > delta->size)
+		c->nslots = (delta->size-Tblk-tsize)/Chunk;
+	if(delta->size < Tblk || c->nslots == 0)
+		error("delta too small");
+	c->doff = Tblk+tsize;
+
+	c->nhash = c->nslots/4+1;
+	c->cbase = malloc(Chunk+Tblk+CACHELINESIZE);
+	c->tab = malloc(c->nslots*sizeof c->tab[0]);
+	c->next = malloc(c->nslots*sizeof c->next[0]);
+	c->hash = malloc(c->nhash*sizeof c->hash[0]);
+	if(c->cbase == nil || c->tab == nil || c->next == nil || c->hash == nil) {
+		cowfree(c);
+		error(Enomem);
+	}
+	c->cbuf = (uchar*)(((ulong)c->cbase+CACHELINESIZE-1)&~(CACHELINESIZE-1));
+	c->tbuf = c->cbuf+Chunk;
+
+	c->base = base;
+	c->delta = delta;
+	if(waserror()) {
+		c->base = c->delta = nil;
+		cowfree(c);
+		nexterror();
+	}
+	load(c, cb->nf == 4);
+	poperror();
+	poperror();
+	poperror();
+	c->d->alignmask = base->alignmask | delta->alignmask;
+	if(c->state == Smerging)
+		merge(c);
+}
+
+static void
+cowinit(Store*)
+{
+}
+
+static void
+cowdevinit(Store *d)
+{
+	Cow *c;
+
+	c = d->ctlr;
+	if(c->base == nil)
+		error(Enocow);
+	d->size = c->base->size;
+	free(d->descr);
+	d->descr = smprint("copy-on-write overlay of %s, delta %s", c->base->name, c->delta->name);
+}
+
+static long
+cowrctl(Store *d, void *a, long n, vlong off)
+{
+	Cow *c;
+	char *buf, *p, *e;
+
+	c = d->ctlr;
+	buf = smalloc(READSTR);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	p = buf;
+	e = buf+READSTR;
+	if(c->base == nil)
+		p = seprint(p, e, "not created\n");
+	else {
+		p = seprint(p, e, "base %s delta %s chunk %d\n", c->base->name, c->delta->name, Chunk);
+		p = seprint(p, e, "snapshot %s generation %lud\n", states[c->state], c->gen);
+		p = seprint(p, e, "slots used %lud mapped %lud total %lud\n", c->nused, c->nmapped, c->nslots);
+		if(c->merging)
+			p = seprint(p, e, "merge %lud/%lud\n", c->mergeslot, c->nused);
+		p = seprint(p, e, "copy-ups %lud merged %lud\n", c->ncopyup, c->nmerged);
+		p = seprint(p, e, "chunk i/o base %lud delta %lud\n", c->nbase, c->ndelta);
+	}
+	USED(p);
+	n = readstr(off, a, n, buf);
+	poperror();
+	free(buf);
+	return n;
+}
+
+enum {
+	CMcreate, CMsnap, CMmerge, CMdelete, CMrevert,
+};
+static Cmdtab cowctl[] = {
+	CMcreate,	"create",	0,
+	CMsnap,		"snap",		1,
+	CMmerge,	"merge",	1,
+	CMdelete,	"delete",	1,
+	CMrevert,	"revert",	1,
+};
+
+static long
+cowwctl(Store *d, void *a, long n)
+{
+	Cow *c;
+	Cmdbuf *cb;
+	Cmdtab *ct;
+	int reinit;
+
+	c = d->ctlr;
+	cb = parsecmd(a, n);
+	if(waserror()) {
+		free(cb);
+		nexterror();
+	}
+	ct = lookupcmd(cb, cowctl, nelem(cowctl));
+	if(ct->index != CMcreate && c->base == nil)
+		error(Enocow);
+
+	/*
+	 * writes cached before snap belong to the frozen image, those
+	 * before revert to the dropped one.  the flush does its i/o
+	 * through cowio, so before wlocking rw.
+	 */
+	if(ct->index == CMsnap || ct->index == CMrevert)
+		bscacheflush(d);
+
+	wlock(&c->rw);
+	qlock(c);
+	if(waserror()) {
+		qunlock(c);
+		wunlock(&c->rw);
+		nexterror();
+	}
+
+	reinit = 0;
+	switch(ct->index) {
+	case CMcreate:
+		if(cb->nf != 3 && cb->nf != 4)
+			error(Ebadarg);
+		cowcreate(c, cb);
+		reinit = 1;
+		break;
+	case CMsnap:
+		if(c->state != Snone)
+			error("snapshot exists");
+		/* map is empty without snapshot */
+		hdrwrite(c, c->gen+1, Sactive);
+		c->gen++;
+		c->state = Sactive;
+		break;
+	case CMmerge:
+	case CMdelete:
+		if(c->state == Snone)
+			error("no snapshot");
+		merge(c);
+		break;
+	case CMrevert:
+		if(c->state != Sactive)
+			error(c->state == Snone ? "no snapshot" : "merge in progress");
+		hdrwrite(c, c->gen+1, Snone);
+		c->gen++;
+		c->state = Snone;
+		mapreset(c);
+		c->full = 0;
+		reinit = 1;
+		break;
+	}
+
+	poperror();
+	qunlock(c);
+	wunlock(&c->rw);
+	poperror();
+	free(cb);
+
+	/*
+	 * read the partitions, in a new process since d is locked by our caller.
+	 * after revert, this also drops cached data of the dropped writes.
+	 */
+	if(reinit)
+		blockstoreready(d);
+	return n;
+}
+
+void
+cowlink(void)
+{
+	Store *d;
+	int i;
+
+	for(i = 0; i < Ncow; i++) {
+		d = &stores[i];
+		cows[i].d = d;
+		d->ctlr = &cows[i];
+		d->num = Firstnum+i;
+		strcpy(d->devtype, "cow");
+		d->init = cowinit;
+		d->devinit = cowdevinit;
+		d->rctl = cowrctl;
+		d->wctl = cowwctl;
+		d->io = cowio;
+		blockstoreadd(d);
+	}
+}
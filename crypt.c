@@ -0,0 +1,429 @@
+/*
+ * encrypted block stores, on top of another store.  bs20 and up.
+ * configured through their devctl file:
+ *	echo create bs01 hexkey >/dev/bs20/devctl
+ * the key is 16, 24 or 32 bytes, for aes-128, -192 or -256.
+ *
+ * each 512-byte sector is encrypted with aes in cbc mode.  the iv is
+ * the sector number (little-endian, zero-padded), encrypted with
+ * sha256 of the key (essiv).  the aes engines (kwaes.c) are used by
+ * default, "engine sw" selects libsec's aes.
+ * the ivs of all sectors of a request are computed in one engine
+ * session, then the sectors in another, so keys are not reloaded per
+ * sector.  "bench" checks that engine and software agree, and measures
+ * them and the store, the result is shown in the ctl file.
+ */
+
+#include	"u.h"
+#include	"../port/lib.h"
+#include	"mem.h"
+#include	"dat.h"
+#include	"fns.h"
+#include	"../port/error.h"
+#include	"libsec.h"
+#include	"part.h"
+#include	"bs.h"
+
+typedef struct Crypt Crypt;
+
+enum {
+	Ncrypt		= 2,
+	Firstnum	= 20,		/* Store.num of first encrypted store */
+	Secsize		= 512,
+	Cryptbuf	= 64*1024,	/* writes are encrypted in a copy, in pieces of this size */
+	Batch		= 32,		/* sectors per engine session, for ivs on the stack */
+	Benchbytes	= 4*1024*1024,
+};
+
+struct Crypt
+{
+	QLock;			/* for configuration */
+	Store	*d;
+	Store	*bs;		/* backing store, nil when not created */
+	int	keybytes;
+	int	hw;		/* use aes engine */
+
+	uchar	key[AESmaxkey];
+	uchar	saltkey[SHA2_256dlen];
+	QLock	swl;		/* for aes and salt, their ivec changes */
+	AESstate	aes;
+	AESstate	salt;
+
+	ulong	nenc;		/* sectors */
+	ulong	ndec;
+	char	bench[128];	/* result of last "bench" */
+};
+
+static Crypt crypts[Ncrypt];
+static Store stores[Ncrypt];
+
+static char Enocrypt[] = "encrypted store not created";
+
+/* en- or decrypt up to Batch sectors at p, the first is sector sect */
+static void
+batchcrypt(Crypt *c, uchar *p, int ns, uvlong sect, int enc, int hw)
+{
+	uchar ivs[Batch*AESbsize], *iv;
+	int i, j;
+
+	memset(ivs, 0, ns*AESbsize);
+	for(i = 0; i < ns; i++)
+		for(j = 0; j < 8; j++)
+			ivs[i*AESbsize+j] = (sect+i)>>(8*j);
+
+	if(!hw) {
+		qlock(&c->swl);
+		for(i = 0; i < ns; i++) {
+			/* cbc of one block with zero ivec is ecb */
+			iv = ivs+i*AESbsize;
+			memset(c->salt.ivec, 0, AESbsize);
+			aesCBCencrypt(iv, AESbsize, &c->salt);
+			memmove(c->aes.ivec, iv, AESbsize);
+			if(enc)
+				aesCBCencrypt(p+i*Secsize, Secsize, &c->aes);
+			else
+				aesCBCdecrypt(p+i*Secsize, Secsize, &c->aes);
+		}
+		qunlock(&c->swl);
+		return;
+	}
+
+	/* engine sessions cannot fail once started */
+	kwaesbegin(1, c->saltkey, sizeof c->saltkey);
+	kwaesrun(1, ivs, ns*AESbsize, nil);
+	kwaesend(1);
+	kwaesbegin(enc, c->key, c->keybytes);
+	for(i = 0; i < ns; i++)
+		kwaesrun(enc, p+i*Secsize, Secsize, ivs+i*AESbsize);
+	kwaesend(enc);
+}
+
+/* en- or decrypt the n/Secsize sectors at p, the first is sector sect */
+static void
+sectorcrypt(Crypt *c, uchar *p, long n, uvlong sect, int enc, int hw)
+{
+	long i, ns;
+
+	ns = n/Secsize;
+	for(i = 0; i < ns; i += Batch)
+		batchcrypt(c, p+i*Secsize, ns-i < Batch ? ns-i : Batch, sect+i, enc, hw);
+}
+
+static long
+backio(Crypt *c, int iswrite, void *buf, long n, vlong off)
+{
+	Bsreq r;
+
+	memset(&r, 0, sizeof r);
+	r.iswrite = iswrite;
+	r.buf = buf;
+	r.n = n;
+	r.off = off;
+	bssubmit(c->bs, &r);
+	return bswait(&r);
+}
+
+static long
+cryptio(void *a, int iswrite, void *buf, long n, vlong off)
+{
+	Store *d;
+	Crypt *c;
+	uchar *p, *b;
+	long h, l;
+
+	d = a;
+	c = d->ctlr;
+	if(c->bs == nil)
+		error(Enocrypt);
+	if(off < 0 || off > d->size || off % Secsize != 0 || n % Secsize != 0)
+		error(Ebadarg);
+	if(n > d->size-off)
+		n = d->size-off;
+
+	p = buf;
+	if(!iswrite) {
+		n = backio(c, 0, p, n, off);
+		n -= n % Secsize;
+		sectorcrypt(c, p, n, off/Secsize, 0, c->hw);
+		c->ndec += n/Secsize;
+		return n;
+	}
+
+	/* the caller's buffer must not change, encrypt a copy */
+	b = smalloc(n < Cryptbuf ? n : Cryptbuf);
+	if(waserror()) {
+		free(b);
+		nexterror();
+	}
+	for(h = 0; h < n; h += l) {
+		l = n-h;
+		if(l > Cryptbuf)
+			l = Cryptbuf;
+		memmove(b, p+h, l);
+		sectorcrypt(c, b, l, (off+h)/Secsize, 1, c->hw);
+		c->nenc += l/Secsize;
+		if(backio(c, 1, b, l, off+h) != l)
+			error("short write");
+	}
+	poperror();
+	free(b);
+	return n;
+}
+
+static ulong
+kbps(vlong n, uvlong us)
+{
+	if(us == 0)
+		us = 1;
+	return n*1000000/us/1024;
+}
+
+/* "bench": en- and decrypt in memory with engine and software, read the store */
+static void
+cryptbench(Crypt *c)
+{
+	uchar *b, *x;
+	uvlong t0, us[4];
+	vlong n, sn;
+	long i;
+	int k;
+
+	b = smalloc(2*Cryptbuf);
+	if(waserror()) {
+		free(b);
+		nexterror();
+	}
+
+	/* same ciphertext from both, and back */
+	x = b+Cryptbuf;
+	for(i = 0; i < Cryptbuf; i++)
+		b[i] = i*7;
+	memmove(x, b, Cryptbuf);
+	sectorcrypt(c, b, Cryptbuf, 1, 1, 1);
+	sectorcrypt(c, x, Cryptbuf, 1, 1, 0);
+	if(memcmp(b, x, Cryptbuf) != 0)
+		error("engine and software encrypt differently");
+	sectorcrypt(c, x, Cryptbuf, 1, 0, 1);
+	for(i = 0; i < Cryptbuf; i++)
+		if(x[i] != (uchar)(i*7))
+			error("engine does not decrypt");
+
+	n = Benchbytes;
+	for(k = 0; k < 4; k++) {
+		/* hw enc, hw dec, sw enc, sw dec */
+		t0 = clockus();
+		for(i = 0; i < n/Cryptbuf; i++)
+			sectorcrypt(c, b, Cryptbuf, i*(Cryptbuf/Secsize), k%2 == 0, k < 2);
+		us[k] = clockus()-t0;
+	}
+	sn = c->bs->size < n ? c->bs->size & ~(vlong)(Cryptbuf-1) : n;
+	t0 = clockus();
+	for(i = 0; i < sn/Cryptbuf; i++)
+		if(backio(c, 0, b, Cryptbuf, (vlong)i*Cryptbuf) != Cryptbuf)
+			error("short read");
+	t0 = clockus()-t0;
+	snprint(c->bench, sizeof c->bench, "bench KB/s: hw enc %lud dec %lud, sw enc %lud dec %lud, %s read %lud\n",
+		kbps(n, us[0]), kbps(n, us[1]), kbps(n, us[2]), kbps(n, us[3]), c->bs->name, kbps(sn, t0));
+	poperror();
+	free(b);
+}
+
+static int
+unhex(int c)
+{
+	if(c >= '0' && c <= '9')
+		return c-'0';
+	if(c >= 'a' && c <= 'f')
+		return c-'a'+10;
+	if(c >= 'A' && c <= 'F')
+		return c-'A'+10;
+	return -1;
+}
+
+/* "create store hexkey" */
+static void
+cryptcreate(Crypt *c, Cmdbuf *cb)
+{
+	uchar key[AESmaxkey], digest[SHA2_256dlen];
+	Store *bs;
+	char *k;
+	int i, n, hi, lo;
+
+	if(c->bs != nil)
+		error("already created");
+	bs = blockstorelookup(cb->f[1]);
+	if(bs == nil)
+		error("no such store");
+	if(bs == c->d)
+		error("store cannot be on itself");
+	if(bs->ready == 0)
+		error("store not ready");
+	if(bs->size < Secsize)
+		error("store too small");
+
+	bsclaim(bs, c->d, 0);
+	if(waserror()) {
+		memset(key, 0, sizeof key);
+		bsunclaim(bs);
+		nexterror();
+	}
+	k = cb->f[2];
+	n = strlen(k)/2;
+	if(strlen(k) % 2 != 0 || n != 16 && n != 24 && n != 32)
+		error("bad key length");
+	for(i = 0; i < n; i++) {
+		hi = unhex(k[2*i]);
+		lo = unhex(k[2*i+1]);
+		if(hi < 0 || lo < 0)
+			error("bad key");
+		key[i] = hi<<4 | lo;
+	}
+	poperror();
+	sha2_256(key, n, digest, nil);
+
+	memmove(c->key, key, n);
+	memmove(c->saltkey, digest, sizeof digest);
+	setupAESstate(&c->aes, key, n, nil);
+	setupAESstate(&c->salt, digest, sizeof digest, nil);
+	memset(key, 0, sizeof key);
+	memset(digest, 0, sizeof digest);
+
+	c->keybytes = n;
+	c->d->alignmask = bs->alignmask | (Secsize-1);
+	c->bs = bs;
+}
+
+static void
+cryptinit(Store*)
+{
+}
+
+static void
+cryptdevinit(Store *d)
+{
+	Crypt *c;
+
+	c = d->ctlr;
+	if(c->bs == nil)
+		error(Enocrypt);
+	d->size = c->bs->size & ~(vlong)(Secsize-1);
+	free(d->descr);
+	d->descr = smprint("aes-%d cbc-essiv on %s", c->keybytes*8, c->bs->name);
+}
+
+static long
+cryptrctl(Store *d, void *a, long n, vlong off)
+{
+	Crypt *c;
+	char *buf, *p, *e;
+
+	c = d->ctlr;
+	buf = smalloc(READSTR);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	p = buf;
+	e = buf+READSTR;
+	if(c->bs == nil)
+		p = seprint(p, e, "not created\n");
+	else {
+		p = seprint(p, e, "store %s\n", c->bs->name);
+		p = seprint(p, e, "cipher aes-%d cbc-essiv\n", c->keybytes*8);
+	}
+	p = seprint(p, e, "engine %s\n", c->hw ? "hw" : "sw");
+	p = seprint(p, e, "sectors encrypted %lud decrypted %lud\n", c->nenc, c->ndec);
+	p = seprint(p, e, "engine key loads enc %lud dec %lud\n", kwaesloads(1), kwaesloads(0));
+	p = seprint(p, e, "%s", c->bench);
+	USED(p);
+	n = readstr(off, a, n, buf);
+	poperror();
+	free(buf);
+	return n;
+}
+
+enum {
+	CMcreate, CMengine, CMbench,
+};
+static Cmdtab cryptctl[] = {
+	CMcreate,	"create",	3,
+	CMengine,	"engine",	2,
+	CMbench,	"bench",	1,
+};
+
+static long
+cryptwctl(Store *d, void *a, long n)
+{
+	Crypt *c;
+	Cmdbuf *cb;
+	Cmdtab *ct;
+	int created;
+
+	c = d->ctlr;
+	cb = parsecmd(a, n);
+	qlock(c);
+	if(waserror()) {
+		qunlock(c);
+		free(cb);
+		nexterror();
+	}
+
+	created = 0;
+	ct = lookupcmd(cb, cryptctl, nelem(cryptctl));
+	switch(ct->index) {
+	case CMcreate:
+		if(waserror()) {
+			memset(cb->f[2], 0, strlen(cb->f[2]));
+			nexterror();
+		}
+		cryptcreate(c, cb);
+		poperror();
+		memset(cb->f[2], 0, strlen(cb->f[2]));
+		created = 1;
+		break;
+	case CMengine:
+		if(strcmp(cb->f[1], "hw") == 0)
+			c->hw = 1;
+		else if(strcmp(cb->f[1], "sw") == 0)
+			c->hw = 0;
+		else
+			error(Ebadarg);
+		break;
+	case CMbench:
+		if(c->bs == nil)
+			error(Enocrypt);
+		cryptbench(c);
+		break;
+	}
+
+	poperror();
+	qunlock(c);
+	free(cb);
+
+	/* read the partitions, in a new process since d is locked by our caller */
+	if(created)
+		blockstoreready(d);
+	return n;
+}
+
+void
+cryptlink(void)
+{
+	Store *d;
+	int i;
+
+	for(i = 0; i < Ncrypt; i++) {
+		d = &stores[i];
+		crypts[i].d = d;
+		crypts[i].hw = 1;
+		d->ctlr = &crypts[i];
+		d->num = Firstnum+i;
+		strcpy(d->devtype, "crypt");
+		d->init = cryptinit;
+		d->devinit = cryptdevinit;
+		d->rctl = cryptrctl;
+		d->wctl = cryptwctl;
+		d->io = cryptio;
+		blockstoreadd(d);
+	}
+}
@@ -3,10 +3,6 @@
  *
  * todo:
  * - check if plan 9 part start,end sectors are offset by 2 (for bootcode & table)
- * - allow misaligned writes, by reading the data before writing?
- * - add hooks so devices can tell they have gone/arrived.
- * - understand extended partitions
- * - hotplug & events, make event-file per Qdiskpart too.
  * - think of way to update the partition table.  for now, write to the data file, then reinit the device.
  */
 
@@ -25,6 +21,7 @@ static char Ebadalign[] = "misaligned request";
 static char Estale[] = "disk changed";
 
 typedef struct Buf Buf;
+typedef struct Evq Evq;
 struct Buf
 {
 	long	n;
@@ -37,7 +34,7 @@ struct Buf
 #define QPATH(p,d,t)	((p)<<16 | (d)<<8 | (t)<<0)
 enum{
 	Qdir, Qbsctl, Qbsevent,
-	Qdiskdir, Qdiskctl, Qdiskdevctl, Qdiskevent, Qdiskraw, Qdiskpart,
+	Qdiskdir, Qdiskctl, Qdiskdevctl, Qdiskevent, Qdiskraw, Qdiskstats, Qdiskpart,
 };
 static
 Dirtab bstab[] = {
@@ -49,15 +46,200 @@ Dirtab bstab[] = {
 	"devctl",	{Qdiskdevctl},		0,	0660,
 	"event",	{Qdiskevent},		0,	0440,
 	"raw",		{Qdiskraw},		0,	0660,
+	"stats",	{Qdiskstats},		0,	0440,
 	"xxx",		{Qdiskpart},		0,	0660,
 };
 
+/* queue of an open bsevent or bsXX/event file */
+struct Evq
+{
+	Queue	*q;
+	int	disk;		/* Store.num, or -1 for bsevent */
+	Evq	*next;
+};
+
+enum {
+	Evqsize		= 8*1024,
+};
+
 static struct {
 	RWlock;
 	Store**	disks;		/* indexed by Store.num */
 	int	maxdisk;	/* highest index of disk */
+
+	Lock	evlock;		/* ilock, for evqs */
+	Evq	*evqs;
 } bs;
 
+enum {
+	Nbounce		= 4,
+	Bouncesize	= 64*1024,
+};
+
+/* dma bounce buffers for misaligned requests, shared by all stores */
+static struct {
+	Lock;
+	Rendez	r;
+	uchar	*free[Nbounce];
+	int	nfree;
+
+	ulong	nbounces;	/* requests copied through a bounce buffer */
+	uvlong	nbytes;
+	ulong	nwaits;		/* times no buffer was free */
+} bounce;
+
+/*
+ * state of a store as seen by reads and writes of partition files,
+ * which take no lock.  users hold a reference, counted with
+ * interrupts off (there is one cpu).  the Store fields involved only
+ * change after a new Snap has been published with snappublish, which
+ * waits for users of the old one to finish.  the data path thus
+ * never sees a store during init.
+ */
+struct Snap
+{
+	int	ref;
+	int	retired;	/* replaced, last user wakes r */
+	Rendez	r;
+	int	vers;
+	int	ready;
+	Part	*parts;
+	int	nparts;
+};
+
+static vlong	cachepurge(Store*);
+
+static Snap*
+snapget(Store *d)
+{
+	Snap *s;
+	int x;
+
+	x = splhi();
+	s = d->snap;
+	s->ref++;
+	splx(x);
+	return s;
+}
+
+/* the wakeup is done with interrupts off, so s is not freed under us */
+static void
+snapput(Snap *s)
+{
+	int x;
+
+	x = splhi();
+	if(--s->ref == 0 && s->retired)
+		wakeup(&s->r);
+	splx(x);
+}
+
+static int
+snapidle(void *a)
+{
+	return ((Snap*)a)->ref == 0;
+}
+
+/* make current state of d visible to the data path, ready or not.  called with d wlocked. */
+static void
+snappublish(Store *d, int ready)
+{
+	Snap *s, *o;
+	int x;
+
+	s = smalloc(sizeof s[0]);
+	s->vers = d->vers;
+	s->ready = ready;
+	s->parts = d->parts;
+	s->nparts = d->nparts;
+
+	x = splhi();
+	o = d->snap;
+	d->snap = s;
+	if(o != nil)
+		o->retired = 1;
+	splx(x);
+	if(o == nil)
+		return;
+	while(waserror())
+		{}
+	sleep(&o->r, snapidle, o);
+	poperror();
+	free(o);
+}
+
+/*
+ * events.  each open of bsevent or bsXX/event gets its own queue,
+ * one record per read:
+ *	arrive bsXX		device or card connected
+ *	remove bsXX		device or card gone
+ *	ready bsXX size nparts	initialised, partitions read
+ *	part bsXX nparts	partitions reread
+ *	error bsXX msg		initialisation or partitions failed
+ *	corrupt bsXX off	checksum mismatch, posted by stores
+ * bsevent gets the records of all stores.  readers that do not
+ * keep up lose records.  bspost may be called from interrupt context.
+ */
+void
+bspost(Store *d, char *fmt, ...)
+{
+	char buf[ERRMAX+64];
+	va_list arg;
+	Evq *e;
+	int n;
+
+	va_start(arg, fmt);
+	n = vseprint(buf, buf+sizeof buf, fmt, arg)-buf;
+	va_end(arg);
+
+	ilock(&bs.evlock);
+	for(e = bs.evqs; e != nil; e = e->next)
+		if(e->disk < 0 || e->disk == d->num)
+			qproduce(e->q, buf, n);
+	iunlock(&bs.evlock);
+}
+
+static void
+evopen(Chan *c)
+{
+	Evq *e;
+
+	e = smalloc(sizeof e[0]);
+	e->q = qopen(Evqsize, Qmsg, nil, nil);
+	if(e->q == nil) {
+		free(e);
+		error(Enomem);
+	}
+	qnoblock(e->q, 1);
+	e->disk = -1;
+	if(QTYPE(c->qid.path) == Qdiskevent)
+		e->disk = QDISK(c->qid.path);
+
+	ilock(&bs.evlock);
+	e->next = bs.evqs;
+	bs.evqs = e;
+	iunlock(&bs.evlock);
+	c->aux = e;
+}
+
+static void
+evclose(Chan *c)
+{
+	Evq *e, **l;
+
+	e = c->aux;
+	ilock(&bs.evlock);
+	for(l = &bs.evqs; *l != nil; l = &(*l)->next)
+		if(*l == e) {
+			*l = e->next;
+			break;
+		}
+	iunlock(&bs.evlock);
+	qfree(e->q);
+	free(e);
+	c->aux = nil;
+}
+
 static Store*
 diskget(int num)
 {
@@ -66,89 +248,1791 @@ diskget(int num)
 	return nil;
 }
 
-enum {
-	/* arg "wl" */
-	Readlock	= 0,
-	Writelock	= 1,
-};
-/* returns r or w-locked Store */
-static Store*
-diskgetlock(int num, int wl)
+enum {
+	/* arg "wl" */
+	Readlock	= 0,
+	Writelock	= 1,
+};
+/* returns r or w-locked Store */
+static Store*
+diskgetlock(int num, int wl)
+{
+	Store *d;
+
+	rlock(&bs);
+	d = diskget(num);
+	if(d == nil) {
+		runlock(&bs);
+		error(Enodisk);
+	}
+	if(wl)
+		wlock(d);
+	else
+		rlock(d);
+	runlock(&bs);
+	return d;
+}
+
+static void
+partdata(Part *p, vlong size)
+{
+	p->index = 0;
+	p->typ = 0;
+	strcpy(p->name, "data");
+	p->s = 0;
+	p->e = size;
+	p->size = size;
+	strcpy(p->uid, eve);
+	p->perm = 0660;
+	p->isopen = 0;
+}
+
+/* fresh statistics for each partition */
+static void
+pstatsinit(Store *d)
+{
+	free(d->pstats);
+	d->pstats = malloc(d->nparts*sizeof d->pstats[0]);
+	if(d->pstats == nil)
+		error(Enomem);
+	d->npstats = d->nparts;
+}
+
+/*
+ * (re)initialise d and read its partitions.  dirty cached blocks were
+ * acknowledged to writers, they are written to the store first.  if
+ * that fails, d is left as it was.  called with d wlocked.
+ */
+static void
+diskinit(Store *d)
+{
+	snappublish(d, 0);
+	if(d->ready) {
+		if(waserror()) {
+			snappublish(d, 1);
+			nexterror();
+		}
+		cacheflush(d, 1);
+		poperror();
+	}
+	d->ready = 0;
+	d->nparts = 0;
+	d->vers++;
+	cachepurge(d);
+	d->devinit(d);
+	if(d->size & d->alignmask)
+		error("misaligned size");
+
+	d->parts = realloc(d->parts, sizeof d->parts[0]);
+	partdata(&d->parts[0], d->size);
+	d->nparts = 1;
+	pstatsinit(d);
+	d->ready = 1;
+
+	if(!waserror()) {
+		d->nparts = partinit(d->io, d, d->size, &d->parts);
+		pstatsinit(d);
+		poperror();
+	} else {
+		print("partinit: %s\n", up->env->errstr);
+		bspost(d, "error %s %q\n", d->name, up->env->errstr);
+	}
+	snappublish(d, 1);
+	bspost(d, "ready %s %lld %d\n", d->name, d->size, d->nparts-1);
+}
+
+static Part*
+partget(Store *d, int i)
+{
+	if(i < 0 || i >= d->nparts)
+		return nil;
+	return &d->parts[i];
+}
+
+static Part*
+xpartget(Store *d, int i)
+{
+	Part *p;
+
+	if(d->ready == 0)
+		error(Enodisk);
+	p = partget(d, i);
+	if(p == nil)
+		error(Enopart);
+	return p;
+}
+
+/*
+ * request scheduler, one per store.  readers and writers queue their
+ * requests, a kproc per store dispatches them.  queued requests
+ * adjacent to the one dispatched are merged into a single request.
+ * with policy "deadline", requests are served in one direction of
+ * increasing offset (elevator), unless a request has been waiting
+ * past its deadline.  policy "noop" serves in arrival order.
+ * at most "depth" dispatched requests are outstanding at the store,
+ * the rest stays queued for merging and sorting.
+ */
+enum {
+	Snoop, Sdeadline,
+
+	Maxdepth	= 32,
+	Maxmerge	= 128*1024,	/* bytes */
+	Readexpire	= 500,		/* ms */
+	Writeexpire	= 5000,
+};
+static char *policies[] = {
+	"noop",
+	"deadline",
+};
+
+typedef struct Sreq Sreq;
+typedef struct Batch Batch;
+typedef struct Wrange Wrange;
+
+struct Sreq
+{
+	Bsreq;
+	ulong	deadline;	/* in ticks */
+	Sreq	*snext;
+};
+
+/* sectors of a write in flight */
+struct Wrange
+{
+	vlong	off;
+	vlong	n;
+	Wrange	*next;
+};
+
+/* request as dispatched to the store, of one or more merged Sreq's */
+struct Batch
+{
+	Bsreq;
+	Bsched	*sched;
+	Sreq	*reqs;		/* sorted by offset */
+	uchar	*mbuf;		/* buffer for merged requests, nil if not merged */
+	Batch	*bnext;
+};
+
+struct Bsched
+{
+	Lock;
+	Rendez	work;
+	int	started;
+	int	policy;
+	int	depth;
+	int	wflags;		/* Bsreq.flags for writes */
+	Sreq	*q;		/* queued, in arrival order */
+	int	nq;
+	int	inflight;	/* batches at store */
+	Batch	*done;		/* completed, to be finished by kproc */
+	vlong	pos;		/* end of last dispatch */
+
+	ulong	nreqs;
+	ulong	nbatches;
+	ulong	nmerged;	/* requests merged into a batch of another */
+	ulong	nsorted;	/* requests dispatched out of arrival order */
+	ulong	nexpired;	/* requests dispatched because of their deadline */
+	int	maxq;
+
+	/* for read-modify-write of misaligned writes */
+	Wrange	*writes;	/* aligned writes in flight */
+	QLock	rmwl;		/* one read-modify-write at a time */
+	Wrange	*rmw;		/* the one in progress, if any */
+	Rendez	rmwr;		/* rmw waits for overlapping writes */
+	ulong	nrmw;
+	ulong	rmwwaits;
+};
+
+static Bsched*
+schedalloc(Store *d)
+{
+	Bsched *s;
+
+	s = malloc(sizeof s[0]);
+	if(s == nil)
+		panic("no memory");
+	s->policy = Sdeadline;
+	s->depth = 1;
+	if(d->submit != nil)
+		s->depth = 4;
+	return s;
+}
+
+static int
+schedwork(void *a)
+{
+	Bsched *s = a;
+
+	return s->done != nil || s->q != nil && s->inflight < s->depth;
+}
+
+static void
+schedunlink(Bsched *s, Sreq *r)
+{
+	Sreq **l;
+
+	for(l = &s->q; *l != r; l = &(*l)->snext)
+		{}
+	*l = r->snext;
+	r->snext = nil;
+	s->nq--;
+}
+
+/* oldest expired request, else next in the sweep, else wrap around */
+static Sreq*
+schedpick(Bsched *s)
+{
+	Sreq *q, *exp, *next, *low;
+
+	if(s->policy == Snoop)
+		return s->q;
+
+	exp = next = low = nil;
+	for(q = s->q; q != nil; q = q->snext) {
+		if((long)(m->ticks-q->deadline) >= 0 && (exp == nil || (long)(q->deadline-exp->deadline) < 0))
+			exp = q;
+		if(q->off >= s->pos && (next == nil || q->off < next->off))
+			next = q;
+		if(low == nil || q->off < low->off)
+			low = q;
+	}
+	if(exp != nil) {
+		s->nexpired++;
+		return exp;
+	}
+	if(next != nil)
+		return next;
+	return low;
+}
+
+/* take queued requests adjacent to b into b */
+static void
+schedmerge(Bsched *s, Batch *b)
+{
+	Sreq *q, **l;
+	int more;
+
+	do {
+		more = 0;
+		for(q = s->q; q != nil; q = q->snext) {
+			if(q->iswrite != b->iswrite || b->n+q->n > Maxmerge)
+				continue;
+			if(q->off == b->off+b->n) {
+				schedunlink(s, q);
+				for(l = &b->reqs; *l != nil; l = &(*l)->snext)
+					{}
+				*l = q;
+			} else if(q->off+q->n == b->off) {
+				schedunlink(s, q);
+				q->snext = b->reqs;
+				b->reqs = q;
+				b->off = q->off;
+			} else
+				continue;
+			b->flags |= q->flags;
+			b->n += q->n;
+			s->nmerged++;
+			more = 1;
+			break;
+		}
+	} while(more);
+}
+
+/* called by the store, possibly from interrupt */
+static void
+batchdone(Bsreq *r)
+{
+	Batch *b;
+	Bsched *s;
+
+	b = r->aux;
+	s = b->sched;
+	ilock(s);
+	b->bnext = s->done;
+	s->done = b;
+	s->inflight--;
+	iunlock(s);
+	wakeup(&s->work);
+}
+
+static void
+batchstart(Store *d, Batch *b)
+{
+	Sreq *q;
+
+	b->buf = b->reqs->buf;
+	if(b->reqs->snext != nil) {
+		b->mbuf = smalloc(b->n);
+		b->buf = b->mbuf;
+		if(b->iswrite)
+			for(q = b->reqs; q != nil; q = q->snext)
+				memmove(b->mbuf+(q->off-b->off), q->buf, q->n);
+	}
+	b->complete = batchdone;
+	b->aux = b;
+
+	if(waserror()) {
+		bsreqdone(b, 0, up->env->errstr);
+		return;
+	}
+	bssubmit(d, b);
+	poperror();
+}
+
+/* complete the merged requests, in process context */
+static void
+batchfinish(Batch *b)
+{
+	Sreq *q, *next;
+	long n, o;
+
+	for(q = b->reqs; q != nil; q = next) {
+		next = q->snext;
+		o = q->off-b->off;
+		n = b->r-o;
+		if(n < 0)
+			n = 0;
+		if(n > q->n)
+			n = q->n;
+		if(!b->iswrite && b->mbuf != nil)
+			memmove(q->buf, b->mbuf+o, n);
+		bsreqdone(q, n, b->err);
+	}
+	free(b->mbuf);
+	free(b);
+}
+
+static void
+schedproc(void *a)
+{
+	Store *d = a;
+	Bsched *s = d->sched;
+	Batch *b, *done, *next;
+	Sreq *q;
+
+	b = nil;
+	for(;;) {
+		if(b == nil)
+			b = smalloc(sizeof b[0]);
+		sleep(&s->work, schedwork, s);
+
+		ilock(s);
+		done = s->done;
+		s->done = nil;
+		q = nil;
+		if(s->q != nil && s->inflight < s->depth) {
+			q = schedpick(s);
+			if(q != s->q)
+				s->nsorted++;
+			schedunlink(s, q);
+			memset(b, 0, sizeof b[0]);
+			b->sched = s;
+			b->reqs = q;
+			b->iswrite = q->iswrite;
+			b->flags = q->flags;
+			b->off = q->off;
+			b->n = q->n;
+			schedmerge(s, b);
+			s->pos = b->off+b->n;
+			s->inflight++;
+			s->nbatches++;
+		}
+		iunlock(s);
+
+		for(; done != nil; done = next) {
+			next = done->bnext;
+			batchfinish(done);
+		}
+		if(q != nil) {
+			batchstart(d, b);
+			b = nil;
+		}
+	}
+}
+
+/* queue request, it completes through bsreqdone */
+static void
+schedqueue(Store *d, Sreq *r)
+{
+	Bsched *s = d->sched;
+	Sreq **l;
+	int start;
+
+	ilock(s);
+	start = s->started == 0;
+	s->started = 1;
+	for(l = &s->q; *l != nil; l = &(*l)->snext)
+		{}
+	*l = r;
+	if(++s->nq > s->maxq)
+		s->maxq = s->nq;
+	s->nreqs++;
+	iunlock(s);
+
+	if(start) {
+		snprint(up->genbuf, sizeof up->genbuf, "%ssched", d->name);
+		kproc(up->genbuf, schedproc, d, 0);
+	}
+	wakeup(&s->work);
+}
+
+/* queue request and wait for it, called with d rlocked */
+static long
+schedio(Store *d, int iswrite, void *buf, long n, vlong off)
+{
+	Sreq r;
+
+	if(n == 0)
+		return 0;
+
+	memset(&r, 0, sizeof r);
+	r.iswrite = iswrite;
+	if(iswrite)
+		r.flags = d->sched->wflags;
+	r.buf = buf;
+	r.n = n;
+	r.off = off;
+	r.deadline = m->ticks+MS2TK(iswrite ? Writeexpire : Readexpire);
+	schedqueue(d, &r);
+	return bswait(&r);
+}
+
+static void
+schedset(Bsched *s, char *policy, char *depth)
+{
+	int i, n;
+
+	for(i = 0; i < nelem(policies); i++)
+		if(strcmp(policies[i], policy) == 0)
+			break;
+	if(i == nelem(policies))
+		error("unknown scheduling policy");
+	n = s->depth;
+	if(depth != nil) {
+		n = atoi(depth);
+		if(n < 1 || n > Maxdepth)
+			error(Ebadarg);
+	}
+
+	ilock(s);
+	s->policy = i;
+	s->depth = n;
+	iunlock(s);
+	wakeup(&s->work);
+}
+
+static char*
+schedstats(Bsched *s, char *p, char *e)
+{
+	p = seprint(p, e, "fua %s\n", (s->wflags & Bfua) ? "on" : "off");
+	p = seprint(p, e, "sched %s depth %d requests %lud batches %lud merged %lud sorted %lud expired %lud maxqueue %d\n",
+		policies[s->policy], s->depth, s->nreqs, s->nbatches, s->nmerged, s->nsorted, s->nexpired, s->maxq);
+	return seprint(p, e, "rmw %lud waits %lud\n", s->nrmw, s->rmwwaits);
+}
+
+static void
+iostart(Iostats *st, uvlong now)
+{
+	if(st == nil)
+		return;
+	ilock(st);
+	if(st->inflight > 0) {
+		st->busyus += now-st->lastus;
+		st->depthus += st->inflight*(now-st->lastus);
+	}
+	st->lastus = now;
+	if(++st->inflight > st->maxinflight)
+		st->maxinflight = st->inflight;
+	iunlock(st);
+}
+
+static void
+ioend(Iostats *st, int iswrite, long n, int failed, uvlong start, uvlong now)
+{
+	uvlong us;
+	int i;
+
+	if(st == nil)
+		return;
+	us = now-start;
+	for(i = 0; i < Nlathist-1 && us >= 2ULL<<i; i++)
+		{}
+	ilock(st);
+	st->busyus += now-st->lastus;
+	st->depthus += st->inflight*(now-st->lastus);
+	st->lastus = now;
+	st->inflight--;
+	if(failed)
+		st->errors++;
+	else {
+		st->ops[iswrite]++;
+		st->bytes[iswrite] += n;
+		st->lat[iswrite][i]++;
+	}
+	iunlock(st);
+}
+
+static char*
+iostatsprint(char *p, char *e, char *name, Iostats *st)
+{
+	uvlong depth;
+	int i, w;
+
+	depth = 0;
+	if(st->busyus > 0)
+		depth = st->depthus*100/st->busyus;
+	p = seprint(p, e, "%s reads %lud %llud writes %lud %llud errors %lud busyus %llud inflight %d max %d depth %llud.%02llud\n",
+		name, st->ops[0], st->bytes[0], st->ops[1], st->bytes[1], st->errors,
+		st->busyus, st->inflight, st->maxinflight, depth/100, depth%100);
+	for(w = 0; w < 2; w++) {
+		p = seprint(p, e, "%s %s", name, w ? "writelat" : "readlat");
+		for(i = 0; i < Nlathist; i++)
+			p = seprint(p, e, " %lud", st->lat[w][i]);
+		p = seprint(p, e, "\n");
+	}
+	return p;
+}
+
+/*
+ * per store, then per partition:
+ *	name reads ops bytes writes ops bytes errors n busyus us inflight n max n depth avg
+ *	name readlat counts...
+ *	name writelat counts...
+ * latency count i is for requests that took less than 2^(i+1) microseconds, including queueing.
+ */
+static long
+statsread(Store *d, void *a, long n, vlong off)
+{
+	char *buf, *s, *e;
+	int i, len;
+
+	len = (d->npstats+1)*(3*32+(2*Nlathist+4)*12);
+	buf = smalloc(len);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	s = buf;
+	e = buf+len;
+	s = iostatsprint(s, e, d->name, &d->stats);
+	for(i = 0; i < d->npstats && i < d->nparts; i++)
+		s = iostatsprint(s, e, d->parts[i].name, &d->pstats[i]);
+	USED(s);
+	n = readstr(off, a, n, buf);
+	poperror();
+	free(buf);
+	return n;
+}
+
+/* i/o on the store through the scheduler, accounted in the statistics of d and p, if not nil */
+static long
+statio(Store *d, Part *p, int iswrite, void *buf, long n, vlong off)
+{
+	Iostats *ps;
+	uvlong start;
+
+	ps = nil;
+	if(p != nil && p-d->parts < d->npstats)
+		ps = &d->pstats[p-d->parts];
+	start = clockus();
+	iostart(&d->stats, start);
+	iostart(ps, start);
+	if(waserror()) {
+		ioend(&d->stats, iswrite, 0, 1, start, clockus());
+		ioend(ps, iswrite, 0, 1, start, clockus());
+		nexterror();
+	}
+	n = schedio(d, iswrite, buf, n, off);
+	poperror();
+	ioend(&d->stats, iswrite, n, 0, start, clockus());
+	ioend(ps, iswrite, n, 0, start, clockus());
+	return n;
+}
+
+/*
+ * block cache, shared by all stores.  holds Cblksize blocks keyed by
+ * store, vers and offset on the store, for reads of at most Cmaxio
+ * bytes.  larger reads bypass the cache, they are mostly streaming.
+ * eviction is segmented lru: new blocks go to the probation list, a
+ * hit moves a block to the protected list.  the protected list holds
+ * at most 3/4 of the blocks, its overflow goes back to probation.
+ * blocks read once, e.g. during a scan, leave without pushing out
+ * the ones read repeatedly.
+ * writes go through to the store.  when done, cached blocks in range
+ * are updated, or removed when other writes to the store overlapped
+ * in time and the order on the device is unknown.  a block being
+ * filled by a read is marked stale by a write, and not kept.
+ * sequential reads on a partition file prefetch the blocks that
+ * follow, asynchronously through the scheduler.  readers of a block
+ * being prefetched wait for it.
+ * with write-back on, writes of at most Cmaxio are copied into the
+ * cache and the blocks marked dirty.  a kproc per store writes dirty
+ * blocks older than Dirtyage, or all when more than half the dirty
+ * limit is reached, sorted and in batches of adjacent blocks.
+ * writers wait while the store is at its dirty limit.  dirty blocks
+ * are not evicted.  reads from the store are overlaid with cached
+ * blocks, since those can be more recent.
+ */
+enum {
+	Cblksize	= 4*1024,
+	Cmaxio		= 64*1024,
+	Ncachehash	= 1024,
+	Rainit		= 16*1024,	/* first read-ahead window */
+	Ramax		= 128*1024,	/* default maximum window */
+	Maxreadahead	= 1024*1024,
+	Dirtyage	= 5000,		/* ms before a dirty block is written */
+	Flushperiod	= 1000,		/* ms */
+	Dirtymax	= 4*1024*1024,	/* default dirty limit per store, bytes */
+
+	/* Cblock.state */
+	Cfill = 0, Cvalid,
+	/* Cblock.list */
+	Lnone = 0, Lprobe, Lprot,
+};
+
+typedef struct Cblock Cblock;
+typedef struct Clist Clist;
+typedef struct Cwait Cwait;
+typedef struct Pfetch Pfetch;
+typedef struct Rahead Rahead;
+
+struct Cblock
+{
+	Store	*d;
+	int	vers;
+	vlong	off;		/* on store, multiple of Cblksize */
+	long	n;		/* less than Cblksize for last block of store */
+	int	state;
+	int	stale;		/* written to during fill */
+	int	ahead;		/* prefetched, not read yet */
+	int	dirty;
+	int	flushing;	/* being written by cacheflush */
+	ulong	dgen;		/* incremented for each change while dirty */
+	ulong	dtime;		/* ticks when made dirty */
+	int	list;
+	uchar	*data;
+	Cblock	*hnext;
+	Cblock	*prev;
+	Cblock	*next;
+};
+
+struct Clist
+{
+	Cblock	*head;		/* most recently used */
+	Cblock	*tail;
+	int	n;
+};
+
+/* per store */
+struct Bcache
+{
+	int	nblocks;
+	int	nwriting;	/* writes in flight */
+	ulong	wseq;		/* incremented for each write */
+
+	ulong	hits;		/* in blocks */
+	ulong	misses;
+	ulong	bypass;		/* reads too large for the cache */
+	ulong	updates;	/* blocks changed by writes */
+	ulong	invals;		/* blocks removed by writes, discard, raw commands */
+
+	long	ramax;		/* read-ahead window limit, 0 is off */
+	ulong	nahead;		/* blocks prefetched */
+	ulong	aheadhits;	/* prefetched blocks that were read */
+	ulong	aheadwaste;	/* prefetched blocks evicted or invalidated before being read */
+
+	int	wback;		/* write-back on */
+	int	ndirty;
+	int	dirtymax;	/* blocks */
+	int	flushstarted;
+	QLock	flushl;		/* one cacheflush at a time */
+	Rendez	flushr;
+	uvlong	wbytes;		/* bytes written into the cache */
+	ulong	nflushed;	/* blocks written back */
+	ulong	nbatches;
+	ulong	throttled;	/* writes that waited for the dirty limit */
+	ulong	flusherrs;
+	ulong	lost;		/* dirty blocks dropped, when the store changed */
+};
+
+/* process waiting for a prefetch to finish */
+struct Cwait
+{
+	Rendez;
+	ulong	gen;
+	Cwait	*next;
+};
+
+/* asynchronous read of consecutive blocks into the cache */
+struct Pfetch
+{
+	Sreq;
+	Store	*d;
+	uvlong	us;		/* start, for statistics */
+	int	nfill;
+	Cblock	*fill[Cmaxio/Cblksize];
+};
+
+/* per open partition file, in Chan.aux */
+struct Rahead
+{
+	vlong	next;		/* offset of a sequential read */
+	vlong	end;		/* prefetched up to */
+	long	win;
+};
+
+static struct {
+	QLock;
+	int	pct;		/* of memory, 0 is off */
+	int	max;		/* blocks */
+	int	nalloc;
+	Cblock	*free;
+	Cblock	*hash[Ncachehash];
+	Clist	probe;		/* seen once */
+	Clist	prot;		/* seen again */
+	ulong	fillgen;	/* incremented when prefetches finish */
+	Cwait	*waiting;
+} cache;
+
+static Cblock**
+cachehash(Store *d, vlong off)
+{
+	return &cache.hash[(ulong)(off/Cblksize + d->num*7919) % Ncachehash];
+}
+
+static Cblock*
+cachelook(Store *d, vlong off)
+{
+	Cblock *b;
+
+	for(b = *cachehash(d, off); b != nil; b = b->hnext)
+		if(b->d == d && b->off == off && b->vers == d->vers)
+			return b;
+	return nil;
+}
+
+static Clist*
+clist(Cblock *b)
+{
+	return b->list == Lprot ? &cache.prot : &cache.probe;
+}
+
+static void
+clistdel(Cblock *b)
+{
+	Clist *l;
+
+	l = clist(b);
+	if(b->prev != nil)
+		b->prev->next = b->next;
+	else
+		l->head = b->next;
+	if(b->next != nil)
+		b->next->prev = b->prev;
+	else
+		l->tail = b->prev;
+	b->prev = b->next = nil;
+	b->list = Lnone;
+	l->n--;
+}
+
+static void
+clistadd(Cblock *b, int list)
+{
+	Clist *l;
+
+	b->list = list;
+	l = clist(b);
+	b->prev = nil;
+	b->next = l->head;
+	if(l->head != nil)
+		l->head->prev = b;
+	else
+		l->tail = b;
+	l->head = b;
+	l->n++;
+}
+
+/* block was used, move it up */
+static void
+cachetouch(Cblock *b)
+{
+	Cblock *o;
+
+	if(b->ahead) {
+		b->d->cache->aheadhits++;
+		b->ahead = 0;
+	}
+	clistdel(b);
+	clistadd(b, Lprot);
+	if(cache.prot.n > cache.max*3/4 && cache.prot.tail != b) {
+		o = cache.prot.tail;
+		clistdel(o);
+		clistadd(o, Lprobe);
+	}
+}
+
+/* remove b from the cache.  the memory is kept for reuse, unless the cache has shrunk. */
+static void
+cacheremove(Cblock *b)
+{
+	Cblock **l;
+
+	for(l = cachehash(b->d, b->off); *l != b; l = &(*l)->hnext)
+		{}
+	*l = b->hnext;
+	if(b->list != Lnone)
+		clistdel(b);
+	if(b->ahead)
+		b->d->cache->aheadwaste++;
+	if(b->dirty) {
+		b->d->cache->ndirty--;
+		b->d->cache->lost++;
+	}
+	b->d->cache->nblocks--;
+	b->d = nil;
+	if(cache.nalloc > cache.max) {
+		free(b->data);
+		free(b);
+		cache.nalloc--;
+		return;
+	}
+	b->hnext = cache.free;
+	cache.free = b;
+}
+
+/* least recently used block that is not being filled and not dirty, probation first */
+static Cblock*
+cachevictim(void)
+{
+	Cblock *b;
+
+	for(b = cache.probe.tail; b != nil; b = b->prev)
+		if(b->state == Cvalid && !b->dirty)
+			return b;
+	for(b = cache.prot.tail; b != nil; b = b->prev)
+		if(b->state == Cvalid && !b->dirty)
+			return b;
+	return nil;
+}
+
+/* new block for d at off, in state Cfill.  nil if none can be had. */
+static Cblock*
+cachenew(Store *d, vlong off, long n)
+{
+	Cblock *b;
+
+	if(cache.free == nil) {
+		if(cache.nalloc < cache.max) {
+			b = malloc(sizeof b[0]);
+			if(b != nil && (b->data = malloc(Cblksize)) == nil) {
+				free(b);
+				b = nil;
+			}
+			if(b != nil) {
+				cache.nalloc++;
+				b->hnext = cache.free;
+				cache.free = b;
+			}
+		}
+		if(cache.free == nil) {
+			b = cachevictim();
+			if(b == nil)
+				return nil;
+			cacheremove(b);
+			if(cache.free == nil)
+				return nil;
+		}
+	}
+	b = cache.free;
+	cache.free = b->hnext;
+
+	b->d = d;
+	b->vers = d->vers;
+	b->off = off;
+	b->n = n;
+	b->state = Cfill;
+	b->stale = 0;
+	b->ahead = 0;
+	b->dirty = 0;
+	b->flushing = 0;
+	b->list = Lnone;
+	b->hnext = *cachehash(d, off);
+	*cachehash(d, off) = b;
+	d->cache->nblocks++;
+	return b;
+}
+
+/*
+ * remove blocks of d overlapping off,n.  blocks being filled are
+ * marked stale instead.  dirty blocks stay, they are written later.
+ */
+static void
+cacheinval0(Store *d, vlong off, vlong n)
+{
+	Cblock *b;
+	vlong o;
+
+	for(o = off & ~(vlong)(Cblksize-1); o < off+n; o += Cblksize) {
+		b = cachelook(d, o);
+		if(b == nil || b->dirty)
+			continue;
+		if(b->state == Cfill)
+			b->stale = 1;
+		else
+			cacheremove(b);
+		d->cache->invals++;
+	}
+}
+
+static void
+cacheinval(Store *d, vlong off, vlong n)
+{
+	qlock(&cache);
+	cacheinval0(d, off, n);
+	qunlock(&cache);
+}
+
+/*
+ * remove all blocks of d, e.g. when vers changes.  dirty blocks are
+ * lost, callers flush first.  returns the number of dirty bytes lost.
+ */
+static vlong
+cachepurge(Store *d)
+{
+	Cblock *b, *nb;
+	vlong lost;
+	int i;
+
+	lost = 0;
+	qlock(&cache);
+	for(i = 0; i < Ncachehash; i++)
+		for(b = cache.hash[i]; b != nil; b = nb) {
+			nb = b->hnext;
+			if(b->d != d)
+				continue;
+			if(b->state == Cfill || b->flushing)
+				b->stale = 1;
+			else {
+				if(b->dirty)
+					lost += b->n;
+				cacheremove(b);
+			}
+		}
+	qunlock(&cache);
+	return lost;
+}
+
+/* set the cache size in percent of memory, shrinking frees memory right away */
+static void
+cacheset(int pct)
+{
+	Cblock *b;
+
+	if(pct < 0 || pct > 50)
+		error(Ebadarg);
+	qlock(&cache);
+	cache.pct = pct;
+	cache.max = (vlong)conf.npage*BY2PG/100*pct/Cblksize;
+	while(cache.nalloc > cache.max) {
+		b = cache.free;
+		if(b != nil) {
+			cache.free = b->hnext;
+			free(b->data);
+			free(b);
+			cache.nalloc--;
+			continue;
+		}
+		b = cachevictim();
+		if(b == nil)
+			break;
+		cacheremove(b);
+	}
+	qunlock(&cache);
+}
+
+static int
+cached(Store *d, long n)
+{
+	return cache.max > 0 && n <= Cmaxio && d->alignmask < Cblksize && d->owner == nil;
+}
+
+/* whether the cache can hold blocks more recent than the store */
+static int
+wbactive(Store *d)
+{
+	return d->cache->wback || d->cache->ndirty > 0;
+}
+
+/* copy cached blocks of d over buf, just read from the store at off */
+static void
+cacheoverlay0(Store *d, uchar *buf, long n, vlong off)
+{
+	Cblock *b;
+	vlong o, s, e;
+
+	for(o = off & ~(vlong)(Cblksize-1); o < off+n; o += Cblksize) {
+		b = cachelook(d, o);
+		if(b == nil || b->state != Cvalid)
+			continue;
+		s = o < off ? off : o;
+		e = o+b->n < off+n ? o+b->n : off+n;
+		memmove(buf+(s-off), b->data+(s-o), e-s);
+	}
+}
+
+static void
+cacheoverlay(Store *d, uchar *buf, long n, vlong off)
+{
+	qlock(&cache);
+	cacheoverlay0(d, buf, n, off);
+	qunlock(&cache);
+}
+
+static int
+cwaitdone(void *a)
+{
+	return ((Cwait*)a)->gen != cache.fillgen;
+}
+
+/*
+ * wait for a prefetch to finish, called and returns with cache
+ * qlocked.  the waker holds the lock while waking, so w stays
+ * valid until it is done.  prefetches always finish, like bswait
+ * we are not interrupted.
+ */
+static void
+cachewait(void)
+{
+	Cwait w;
+
+	memset(&w, 0, sizeof w);
+	w.gen = cache.fillgen;
+	w.next = cache.waiting;
+	cache.waiting = &w;
+	qunlock(&cache);
+	while(waserror())
+		{}
+	sleep(&w, cwaitdone, &w);
+	poperror();
+	qlock(&cache);
+}
+
+/* called by the scheduler when a prefetch has finished, in process context */
+static void
+prefetchdone(Bsreq *r)
+{
+	Pfetch *f;
+	Cblock *b;
+	Cwait *w, *next;
+	int i;
+
+	f = r->aux;
+	ioend(&f->d->stats, 0, r->r, r->err[0] != 0, f->us, clockus());
+	qlock(&cache);
+	for(i = 0; i < f->nfill; i++) {
+		b = f->fill[i];
+		if(b->stale || r->err[0] != 0 || r->r < b->off-f->off+b->n) {
+			cacheremove(b);
+			continue;
+		}
+		memmove(b->data, (uchar*)f->buf+(b->off-f->off), b->n);
+		b->state = Cvalid;
+		clistadd(b, Lprobe);
+	}
+	cache.fillgen++;
+	for(w = cache.waiting; w != nil; w = next) {
+		next = w->next;
+		wakeup(w);
+	}
+	cache.waiting = nil;
+	qunlock(&cache);
+	free(f->buf);
+	free(f);
+}
+
+/*
+ * start reading blocks of d in off,n that are not cached, in requests
+ * of at most Cmaxio.  done in the background, called with d rlocked.
+ * the i/o is accounted to the store only, partitions can change
+ * before it finishes.
+ */
+static void
+prefetch(Store *d, vlong off, vlong n)
+{
+	Pfetch *f;
+	Cblock *b;
+	vlong o, e;
+	int full;
+
+	o = off & ~(vlong)(Cblksize-1);
+	e = off+n+Cblksize-1 & ~(vlong)(Cblksize-1);
+	if(e > d->size)
+		e = d->size;
+	full = 0;
+	while(o < e && !full) {
+		f = smalloc(sizeof f[0]);
+		qlock(&cache);
+		for(; o < e && cachelook(d, o) != nil; o += Cblksize)
+			{}
+		f->off = o;
+		for(; o < e && f->nfill < nelem(f->fill) && cachelook(d, o) == nil; o += Cblksize) {
+			b = cachenew(d, o, e-o < Cblksize ? e-o : Cblksize);
+			if(b == nil) {
+				full = 1;
+				break;
+			}
+			b->ahead = 1;
+			f->fill[f->nfill++] = b;
+			f->n += b->n;
+		}
+		d->cache->nahead += f->nfill;
+		qunlock(&cache);
+		if(f->nfill == 0) {
+			free(f);
+			continue;
+		}
+
+		f->d = d;
+		f->buf = smalloc(f->n);
+		f->iswrite = 0;
+		f->deadline = m->ticks+MS2TK(Readexpire);
+		f->complete = prefetchdone;
+		f->aux = f;
+		f->us = clockus();
+		iostart(&d->stats, f->us);
+		schedqueue(d, f);
+	}
+}
+
+/*
+ * read-ahead for reads of partition files.  a read starting where the
+ * previous one ended is sequential, and prefetches the win bytes past
+ * the end of the read once half of the earlier prefetch has been read.
+ * win doubles with each prefetch, up to the maximum of the store.  any
+ * other read is random and starts over with no window.
+ */
+static void
+readahead(Chan *c, Store *d, Part *p, vlong off, long n)
+{
+	Rahead *ra;
+	long max;
+	vlong s, e;
+
+	max = d->cache->ramax;
+	if(max == 0 || n <= 0 || !cached(d, n))
+		return;
+	ra = c->aux;
+	if(ra == nil)
+		c->aux = ra = smalloc(sizeof ra[0]);
+	if(off != ra->next) {
+		ra->next = off+n;
+		ra->end = 0;
+		ra->win = 0;
+		return;
+	}
+	ra->next = off+n;
+	if(ra->end < ra->next)
+		ra->end = ra->next;
+	if(ra->end-ra->next > ra->win/2)
+		return;
+	if(ra->win == 0)
+		ra->win = Rainit;
+	else
+		ra->win *= 2;
+	if(ra->win > max)
+		ra->win = max;
+	s = ra->end;
+	e = ra->next+ra->win;
+	if(e > p->size)
+		e = p->size;
+	if(s >= e)
+		return;
+	ra->end = e;
+	prefetch(d, p->s+s, e-s);
+}
+
+/*
+ * read n bytes at off (on the store) through the cache.  if not all
+ * blocks are present, the whole block-aligned range is read from
+ * the store and the missing blocks are filled from it.
+ */
+static long
+cacheread(Store *d, Part *p, uchar *a, long n, vlong off)
+{
+	Bcache *c = d->cache;
+	Cblock *b, *fill[Cmaxio/Cblksize+1];
+	vlong cs, ce, o;
+	uchar *buf;
+	long nn;
+	int i, nfill;
+
+	if(n == 0)
+		return 0;
+	cs = off & ~(vlong)(Cblksize-1);
+	ce = off+n+Cblksize-1 & ~(vlong)(Cblksize-1);
+	if(ce > d->size)
+		ce = d->size;
+
+	qlock(&cache);
+	for(;;) {
+		for(o = cs; o < ce; o += Cblksize) {
+			b = cachelook(d, o);
+			if(b != nil && b->state == Cfill && b->ahead)
+				break;
+		}
+		if(o == ce)
+			break;
+		cachewait();
+	}
+	for(o = cs; o < ce; o += Cblksize) {
+		b = cachelook(d, o);
+		if(b == nil || b->state != Cvalid)
+			break;
+	}
+	if(o == ce) {
+		for(o = cs; o < ce; o += Cblksize) {
+			b = cachelook(d, o);
+			nn = b->n;
+			if(o+nn > off+n)
+				nn = off+n-o;
+			if(o < off)
+				memmove(a, b->data+(off-o), nn-(off-o));
+			else
+				memmove(a+(o-off), b->data, nn);
+			cachetouch(b);
+			c->hits++;
+		}
+		qunlock(&cache);
+		return n;
+	}
+
+	nfill = 0;
+	for(o = cs; o < ce; o += Cblksize) {
+		b = cachelook(d, o);
+		if(b != nil) {
+			if(b->state == Cvalid) {
+				cachetouch(b);
+				c->hits++;
+			}
+			continue;
+		}
+		c->misses++;
+		b = cachenew(d, o, ce-o < Cblksize ? ce-o : Cblksize);
+		if(b != nil)
+			fill[nfill++] = b;
+	}
+	qunlock(&cache);
+
+	buf = nil;
+	if(waserror()) {
+		free(buf);
+		qlock(&cache);
+		for(i = 0; i < nfill; i++)
+			cacheremove(fill[i]);
+		qunlock(&cache);
+		nexterror();
+	}
+	buf = smalloc(ce-cs);
+	nn = statio(d, p, 0, buf, ce-cs, cs);
+	if(nn != ce-cs)
+		error("short read");
+	poperror();
+
+	qlock(&cache);
+	for(i = 0; i < nfill; i++) {
+		b = fill[i];
+		if(b->stale) {
+			cacheremove(b);
+			continue;
+		}
+		memmove(b->data, buf+(b->off-cs), b->n);
+		b->state = Cvalid;
+		clistadd(b, Lprobe);
+	}
+	if(wbactive(d))
+		cacheoverlay0(d, buf, ce-cs, cs);
+	qunlock(&cache);
+
+	memmove(a, buf+(off-cs), n);
+	free(buf);
+	return n;
+}
+
+/* start of write, returns token for cachewend */
+static ulong
+cachewstart(Store *d)
+{
+	Bcache *c = d->cache;
+	ulong tok;
+
+	qlock(&cache);
+	tok = ++c->wseq;
+	if(c->nwriting++ > 0)
+		tok = 0;
+	qunlock(&cache);
+	return tok;
+}
+
+/*
+ * write of n bytes at off has finished, buf is nil on error.  cached
+ * blocks are updated if no other write overlapped in time, otherwise
+ * removed.  dirty blocks always get the data, they are written again.
+ */
+static void
+cachewend(Store *d, ulong tok, uchar *buf, long n, vlong off)
+{
+	Bcache *c = d->cache;
+	Cblock *b;
+	vlong o, s, e;
+	int excl;
+
+	qlock(&cache);
+	excl = buf != nil && tok != 0 && tok == c->wseq && c->nwriting == 1;
+	for(o = off & ~(vlong)(Cblksize-1); o < off+n; o += Cblksize) {
+		b = cachelook(d, o);
+		if(b == nil)
+			continue;
+		if(b->state == Cfill) {
+			b->stale = 1;
+			continue;
+		}
+		if(buf != nil && (excl || b->dirty)) {
+			s = o < off ? off : o;
+			e = o+b->n < off+n ? o+b->n : off+n;
+			memmove(b->data+(s-o), buf+(s-off), e-s);
+			if(b->dirty)
+				b->dgen++;
+			c->updates++;
+		} else if(!b->dirty) {
+			cacheremove(b);
+			c->invals++;
+		}
+	}
+	c->nwriting--;
+	qunlock(&cache);
+}
+
+/* in blocks, at least one so writers cannot wait forever */
+static int
+dirtylimit(Bcache *c)
+{
+	int n;
+
+	n = cache.max/2;
+	if(c->dirtymax < n)
+		n = c->dirtymax;
+	if(n < 1)
+		n = 1;
+	return n;
+}
+
+static int
+cblkcmp(void *a, void *b)
+{
+	Cblock *x, *y;
+
+	x = *(Cblock**)a;
+	y = *(Cblock**)b;
+	if(x->off < y->off)
+		return -1;
+	return x->off > y->off;
+}
+
+/*
+ * write dirty blocks of d to the store, all or only those older than
+ * Dirtyage.  called with d locked.  blocks changed while being
+ * written stay dirty.
+ */
+static void
+cacheflush(Store *d, int all)
+{
+	Bcache *c = d->cache;
+	Cblock *b, **v;
+	ulong *gen;
+	uchar *buf;
+	vlong len;
+	int i, j, k, nv, failed;
+
+	qlock(&c->flushl);
+	v = nil;
+	gen = nil;
+	buf = nil;
+	if(waserror()) {
+		qunlock(&c->flushl);
+		free(v);
+		free(gen);
+		free(buf);
+		nexterror();
+	}
+
+	/* malloc does not sleep, the number of dirty blocks cannot change under us */
+	nv = 0;
+	qlock(&cache);
+	v = malloc((c->ndirty+1)*sizeof v[0]);
+	gen = malloc((c->ndirty+1)*sizeof gen[0]);
+	for(i = 0; v != nil && gen != nil && i < Ncachehash; i++)
+		for(b = cache.hash[i]; b != nil; b = b->hnext)
+			if(b->d == d && b->dirty && b->vers == d->vers && (all || m->ticks-b->dtime >= MS2TK(Dirtyage))) {
+				b->flushing = 1;
+				v[nv++] = b;
+			}
+	qunlock(&cache);
+	if(v == nil || gen == nil)
+		error(Enomem);
+	qsort(v, nv, sizeof v[0], cblkcmp);
+	if(nv > 0)
+		buf = smalloc(Maxmerge);
+
+	failed = 0;
+	for(i = 0; i < nv; i = j) {
+		len = v[i]->n;
+		for(j = i+1; j < nv && v[j]->off == v[j-1]->off+Cblksize && len+v[j]->n <= Maxmerge; j++)
+			len += v[j]->n;
+
+		qlock(&cache);
+		for(k = i; k < j; k++) {
+			memmove(buf+(v[k]->off-v[i]->off), v[k]->data, v[k]->n);
+			gen[k] = v[k]->dgen;
+		}
+		qunlock(&cache);
+
+		if(!failed && !waserror()) {
+			if(statio(d, nil, 1, buf, len, v[i]->off) != len)
+				error("short write");
+			poperror();
+		} else
+			failed = 1;
+
+		qlock(&cache);
+		for(k = i; k < j; k++) {
+			b = v[k];
+			b->flushing = 0;
+			if(b->stale) {
+				cacheremove(b);
+				continue;
+			}
+			if(!failed && b->dgen == gen[k]) {
+				b->dirty = 0;
+				c->ndirty--;
+				c->nflushed++;
+			}
+		}
+		if(!failed)
+			c->nbatches++;
+		qunlock(&cache);
+	}
+	if(failed) {
+		c->flusherrs++;
+		error(up->env->errstr);
+	}
+
+	poperror();
+	qunlock(&c->flushl);
+	free(v);
+	free(gen);
+	free(buf);
+}
+
+static int
+flushwork(void *a)
+{
+	Bcache *c = a;
+
+	return c->ndirty > 0 && c->ndirty >= dirtylimit(c)/2;
+}
+
+/* writes dirty blocks of a store in the background */
+static void
+flushproc(void *a)
+{
+	Store *d = a;
+	Bcache *c = d->cache;
+
+	for(;;) {
+		tsleep(&c->flushr, flushwork, c, Flushperiod);
+		if(c->ndirty == 0)
+			continue;
+		rlock(d);
+		if(waserror()) {
+			runlock(d);
+			tsleep(&up->sleep, return0, nil, Flushperiod);
+			continue;
+		}
+		if(d->ready)
+			cacheflush(d, flushwork(c));
+		poperror();
+		runlock(d);
+	}
+}
+
+/* write aligned buf to the store, keeping the cache coherent */
+static long
+writethrough(Store *d, Part *p, uchar *buf, long n, vlong off)
+{
+	ulong tok;
+
+	tok = cachewstart(d);
+	if(waserror()) {
+		cachewend(d, tok, nil, n, off);
+		nexterror();
+	}
+	n = statio(d, p, 1, buf, n, off);
+	poperror();
+	cachewend(d, tok, buf, n, off);
+	return n;
+}
+
+static int
+overlaps(Wrange *a, Wrange *b)
 {
-	Store *d;
+	return a->off < b->off+b->n && b->off < a->off+a->n;
+}
 
-	rlock(&bs);
-	d = diskget(num);
-	if(d == nil) {
-		runlock(&bs);
-		error(Enodisk);
+/* register aligned write w, after a read-modify-write of the same sectors has finished */
+static void
+wrangeadd(Bsched *s, Wrange *w)
+{
+	for(;;) {
+		ilock(s);
+		if(s->rmw == nil || !overlaps(s->rmw, w)) {
+			w->next = s->writes;
+			s->writes = w;
+			iunlock(s);
+			return;
+		}
+		iunlock(s);
+		qlock(&s->rmwl);
+		qunlock(&s->rmwl);
 	}
-	if(wl)
-		wlock(d);
-	else
-		rlock(d);
-	runlock(&bs);
-	return d;
 }
 
 static void
-partdata(Part *p, vlong size)
+wrangedel(Bsched *s, Wrange *w)
 {
-	p->index = 0;
-	p->typ = 0;
-	strcpy(p->name, "data");
-	p->s = 0;
-	p->e = size;
-	p->size = size;
-	strcpy(p->uid, eve);
-	p->perm = 0660;
-	p->isopen = 0;
+	Wrange **l;
+
+	ilock(s);
+	for(l = &s->writes; *l != w; l = &(*l)->next)
+		{}
+	*l = w->next;
+	iunlock(s);
+	wakeup(&s->rmwr);
+}
+
+static int
+rmwclear(void *a)
+{
+	Bsched *s = a;
+	Wrange *w;
+
+	ilock(s);
+	for(w = s->writes; w != nil; w = w->next)
+		if(overlaps(w, s->rmw))
+			break;
+	iunlock(s);
+	return w == nil;
 }
 
+/* read sector for read-modify-write, cached data can be newer */
 static void
-diskinit(Store *d)
+rmwread(Store *d, Part *p, uchar *buf, long n, vlong off)
 {
-	d->ready = 0;
-	d->nparts = 0;
-	d->vers++;
-	d->devinit(d);
-	if(d->size & d->alignmask)
-		error("misaligned size");
+	if(statio(d, p, 0, buf, n, off) != n)
+		error("short read");
+	if(wbactive(d))
+		cacheoverlay(d, buf, n, off);
+}
 
-	d->parts = realloc(d->parts, sizeof d->parts[0]);
-	partdata(&d->parts[0], d->size);
-	d->nparts = 1;
-	d->ready = 1;
+/*
+ * write to the store, off is on the store.  for misaligned writes the
+ * partial first and last sector are read, modified and written.  they
+ * are done one at a time per store, and wait for aligned writes and
+ * write-back updates (cachewrite) of the same sectors, which in turn
+ * wait for them.
+ */
+static long
+writestore(Store *d, Part *p, uchar *buf, long n, vlong off)
+{
+	Bsched *s = d->sched;
+	Wrange w;
+	uchar *b;
+	vlong xs, xe;
+	long a;
+
+	a = d->alignmask+1;
+	xs = off & ~(vlong)d->alignmask;
+	xe = off+n+d->alignmask & ~(vlong)d->alignmask;
+	w.off = xs;
+	w.n = xe-xs;
+	if(xs == off && xe == off+n) {
+		wrangeadd(s, &w);
+		if(waserror()) {
+			wrangedel(s, &w);
+			nexterror();
+		}
+		n = writethrough(d, p, buf, n, off);
+		poperror();
+		wrangedel(s, &w);
+		return n;
+	}
 
+	qlock(&s->rmwl);
+	b = nil;
 	if(waserror()) {
-		print("partinit: %s\n", up->env->errstr);
-		return;
+		ilock(s);
+		s->rmw = nil;
+		iunlock(s);
+		qunlock(&s->rmwl);
+		free(b);
+		nexterror();
+	}
+	ilock(s);
+	s->rmw = &w;
+	s->nrmw++;
+	iunlock(s);
+	if(!rmwclear(s)) {
+		s->rmwwaits++;
+		sleep(&s->rmwr, rmwclear, s);
 	}
 
-	d->nparts = partinit(d->io, d, d->size, &d->parts);
-
+	b = smalloc(xe-xs);
+	if(xs != off)
+		rmwread(d, p, b, a, xs);
+	if(xe != off+n && (xe-a != xs || xs == off))
+		rmwread(d, p, b+(xe-a-xs), a, xe-a);
+	memmove(b+(off-xs), buf, n);
+	if(writethrough(d, p, b, xe-xs, xs) != xe-xs)
+		error("short write");
 	poperror();
+
+	ilock(s);
+	s->rmw = nil;
+	iunlock(s);
+	qunlock(&s->rmwl);
+	free(b);
+	return n;
 }
 
-static Part*
-partget(Store *d, int i)
+/*
+ * write-back: copy the write into cached blocks and mark them dirty.
+ * parts of blocks that are not cached and not written completely go
+ * to the store directly.  waits while the store has too many dirty
+ * blocks.  off is on the store.
+ */
+static long
+cachewrite(Store *d, Part *p, uchar *a, long n, vlong off)
 {
-	if(i < 0 || i >= d->nparts)
-		return nil;
-	return &d->parts[i];
+	Bcache *c = d->cache;
+	Cblock *b;
+	Bsrange r[Cmaxio/Cblksize+1];
+	Wrange w;
+	vlong o, s, e, bn;
+	int i, nr;
+
+	while(c->ndirty >= dirtylimit(c)) {
+		c->throttled++;
+		wakeup(&c->flushr);
+		tsleep(&up->sleep, return0, nil, 10);
+	}
+
+	/*
+	 * a read-modify-write of the same sectors would write back the
+	 * bytes it read before our update, and put them in the cache.
+	 */
+	w.off = off & ~(vlong)d->alignmask;
+	w.n = (off+n+d->alignmask & ~(vlong)d->alignmask) - w.off;
+	wrangeadd(d->sched, &w);
+
+	nr = 0;
+	qlock(&cache);
+	for(o = off & ~(vlong)(Cblksize-1); o < off+n; o += Cblksize) {
+		bn = d->size-o < Cblksize ? d->size-o : Cblksize;
+		s = o < off ? off : o;
+		e = o+bn < off+n ? o+bn : off+n;
+		b = cachelook(d, o);
+		if(b == nil && s == o && e == o+bn && (b = cachenew(d, o, bn)) != nil) {
+			b->state = Cvalid;
+			clistadd(b, Lprobe);
+		}
+		if(b == nil || b->state != Cvalid) {
+			if(b != nil)
+				b->stale = 1;
+			if(nr > 0 && r[nr-1].off+r[nr-1].n == s)
+				r[nr-1].n += e-s;
+			else {
+				r[nr].off = s;
+				r[nr].n = e-s;
+				nr++;
+			}
+			continue;
+		}
+		memmove(b->data+(s-o), a+(s-off), e-s);
+		if(!b->dirty) {
+			b->dirty = 1;
+			b->dtime = m->ticks;
+			c->ndirty++;
+		}
+		b->dgen++;
+		c->wbytes += e-s;
+	}
+	qunlock(&cache);
+	wrangedel(d->sched, &w);
+
+	/* these register their own ranges */
+	for(i = 0; i < nr; i++)
+		if(writestore(d, p, a+(r[i].off-off), r[i].n, r[i].off) != r[i].n)
+			error("short write");
+	return n;
 }
 
-static Part*
-xpartget(Store *d, int i)
+/* turn write-back on or off, off writes the dirty blocks.  called with d wlocked. */
+static void
+writeback(Store *d, int on, char *limit)
 {
-	Part *p;
+	Bcache *c = d->cache;
+	vlong n;
 
-	if(d->ready == 0)
-		error(Enodisk);
-	p = partget(d, i);
-	if(p == nil)
-		error(Enopart);
-	return p;
+	if(limit != nil) {
+		n = strtoll(limit, nil, 0);
+		if(n < Cblksize || n > 1024*1024*1024)
+			error(Ebadarg);
+		c->dirtymax = n/Cblksize;
+	}
+	if(!on) {
+		c->wback = 0;
+		if(d->ready)
+			cacheflush(d, 1);
+		return;
+	}
+	if(cache.max == 0)
+		error("block cache is off");
+	if(d->alignmask >= Cblksize)
+		error("alignment of store too large for cache");
+	if(!c->flushstarted) {
+		snprint(up->genbuf, sizeof up->genbuf, "%sflush", d->name);
+		kproc(up->genbuf, flushproc, d, 0);
+		c->flushstarted = 1;
+	}
+	c->wback = 1;
+}
+
+static char*
+cachestats(Store *d, char *p, char *e)
+{
+	Bcache *c = d->cache;
+	ulong rate;
+
+	rate = 0;
+	if(c->hits+c->misses > 0)
+		rate = (uvlong)c->hits*100/(c->hits+c->misses);
+	p = seprint(p, e, "writeback %s dirty %d limit %d written %llud flushed %lud batches %lud throttled %lud errors %lud lost %lud\n",
+		c->wback ? "on" : "off", c->ndirty, dirtylimit(c), c->wbytes, c->nflushed, c->nbatches, c->throttled, c->flusherrs, c->lost);
+	p = seprint(p, e, "cache blocks %d bytes %lld hits %lud misses %lud hitrate %lud%% bypass %lud updates %lud invalidates %lud\n",
+		c->nblocks, (vlong)c->nblocks*Cblksize, c->hits, c->misses, rate, c->bypass, c->updates, c->invals);
+	return seprint(p, e, "readahead max %ld prefetched %lud hits %lud wasted %lud\n",
+		c->ramax, c->nahead, c->aheadhits, c->aheadwaste);
 }
 
 static long
@@ -163,8 +2047,6 @@ io(Store *d, Part *p, int iswrite, void *buf, long n, vlong off)
 		error(Enodisk);
 	if(off < 0 || n < 0)
 		error(Ebadarg);
-	if(iswrite && (off&d->alignmask || n&d->alignmask))
-		error(Ebadalign);
 
 	s = off;
 	e = off+n;
@@ -176,6 +2058,17 @@ io(Store *d, Part *p, int iswrite, void *buf, long n, vlong off)
 	e += p->s;
 	n = e-s;
 
+	if(!iswrite && cache.max > 0) {
+		if(cached(d, n))
+			return cacheread(d, p, buf, n, s);
+		d->cache->bypass++;
+	}
+	if(iswrite) {
+		if(d->cache->wback && cached(d, n))
+			return cachewrite(d, p, buf, n, s);
+		return writestore(d, p, buf, n, s);
+	}
+
 	xs = s&~d->alignmask;
 	xn = n+(s&d->alignmask)+d->alignmask & ~d->alignmask;
 
@@ -189,7 +2082,9 @@ io(Store *d, Part *p, int iswrite, void *buf, long n, vlong off)
 		}
 	}
 
-	xn = d->io(d, iswrite, buf, xn, xs);
+	xn = statio(d, p, 0, buf, xn, xs);
+	if(wbactive(d))
+		cacheoverlay(d, buf, xn, xs);
 
 	if(origbuf != nil) {
 		xn -= s-xs;
@@ -256,17 +2151,18 @@ bsgen(Chan *c, char *, Dirtab *, int, int i, Dir *dp)
 	case Qdiskdevctl:
 	case Qdiskevent:
 	case Qdiskraw:
+	case Qdiskstats:
 	case Qdiskpart:
 		d = diskget(QDISK(c->qid.path));
 		if(d == nil || d->ready == 0 && qt == Qdiskpart)
 			return -1;
-		if(i >= 0 && i < Qdiskraw-Qdiskctl+1) {
+		if(i >= 0 && i < Qdiskstats-Qdiskctl+1) {
 			t = &bstab[Qdiskctl+i];
 			mkqid(&qid, QPATH(0,d->num,Qdiskctl+i), 0, QTFILE);
 			devdir(c, qid, t->name, t->length, eve, t->perm, dp);
 			return 1;
 		}
-		i -= Qdiskraw-Qdiskctl+1;
+		i -= Qdiskstats-Qdiskctl+1;
 		if(i >= d->nparts)
 			return -1;
 		p = &d->parts[i];
@@ -281,7 +2177,12 @@ bsgen(Chan *c, char *, Dirtab *, int, int i, Dir *dp)
 static void
 bsreset(void)
 {
+	int i;
+
 	print("bsreset\n");
+	for(i = 0; i < Nbounce; i++)
+		bounce.free[i] = xspanalloc(Bouncesize, CACHELINESIZE, 0);
+	bounce.nfree = Nbounce;
 }
 
 static void
@@ -427,6 +2328,10 @@ bsopen(Chan* c, int omode)
 	}
 
 	if(QTYPE(c->qid.path) == Qdiskpart) {
+		if(d->owner != nil && (!d->ownerrdonly || (omode&3) != OREAD)) {
+			snprint(up->genbuf, sizeof up->genbuf, "%s in use by %s", d->name, d->owner->name);
+			error(up->genbuf);
+		}
 		p = xpartget(d, QPART(c->qid.path));
 		if(p->index == 0)
 			p = nil;
@@ -438,6 +2343,9 @@ bsopen(Chan* c, int omode)
 	} else
 		c = devopen(c, omode, nil, 0, bsgen);
 
+	if(QTYPE(c->qid.path) == Qbsevent || QTYPE(c->qid.path) == Qdiskevent)
+		evopen(c);
+
 	if(storelock) {
 		c->qid.vers = d->vers;
 		poperror();
@@ -463,6 +2371,14 @@ bswstat(Chan* c, uchar *dp, int n)
 	nn = convM2D(dp, n, &dir, nil);
 	if(nn == 0)
 		error(Eshortstat);
+
+	/* null wstat is sync */
+	if(dir.mode == ~0 && dir.atime == ~0 && dir.mtime == ~0 && dir.length == ~0
+	&& *dir.name == 0 && *dir.uid == 0 && *dir.gid == 0 && *dir.muid == 0) {
+		bsflush(c);
+		return n;
+	}
+
 	if(dir.atime != ~0 || dir.mtime != ~0 || dir.length != ~0 || *dir.name || *dir.gid || *dir.muid)
 		error(Eperm);
 
@@ -510,12 +2426,18 @@ bsclose(Chan* c)
 		wunlock(d);
 	}
 
+	if((QTYPE(c->qid.path) == Qbsevent || QTYPE(c->qid.path) == Qdiskevent) && c->aux != nil)
+		evclose(c);
 	if(QTYPE(c->qid.path) == Qdiskraw && c->aux != nil) {
 		b = c->aux;
 		free(b->a);
 		free(b);
 		c->aux = nil;
 	}
+	if(QTYPE(c->qid.path) == Qdiskpart) {
+		free(c->aux);
+		c->aux = nil;
+	}
 }
 
 static long
@@ -559,6 +2481,8 @@ bsdevread(Chan* c, void* a, long n, vlong off)
 				s = seprint(s, e, "part %q %lld %lld\n", p->name, p->s, p->e);
 			}
 		}
+		s = schedstats(d->sched, s, e);
+		s = cachestats(d, s, e);
 		n = readstr(off, a, n, buf);
 
 		poperror();
@@ -573,9 +2497,8 @@ bsdevread(Chan* c, void* a, long n, vlong off)
 		n = d->rctl(d, a, n, off);
 		break;
 
-	case Qdiskpart:
-		p = xpartget(d, QPART(c->qid.path));
-		n = io(d, p, 0, a, n, off);
+	case Qdiskstats:
+		n = statsread(d, a, n, off);
 		break;
 	}
 
@@ -584,6 +2507,42 @@ bsdevread(Chan* c, void* a, long n, vlong off)
 	return n;
 }
 
+/*
+ * read or write of a partition file, without locks.  stores are only
+ * added during boot and never removed, so bs need not be locked.
+ */
+static long
+bsdataio(Chan *c, int iswrite, void *a, long n, vlong off)
+{
+	Store *d;
+	Snap *s;
+	Part *p;
+	int i;
+
+	d = diskget(QDISK(c->qid.path));
+	if(d == nil)
+		error(Enodisk);
+	s = snapget(d);
+	if(waserror()) {
+		snapput(s);
+		nexterror();
+	}
+	if(c->qid.vers != s->vers)
+		error(Estale);
+	if(!s->ready)
+		error(Enodisk);
+	i = QPART(c->qid.path);
+	if(i >= s->nparts)
+		error(Enopart);
+	p = &s->parts[i];
+	n = io(d, p, iswrite, a, n, off);
+	if(!iswrite)
+		readahead(c, d, p, off, n);
+	poperror();
+	snapput(s);
+	return n;
+}
+
 static long
 bsread(Chan* c, void* a, long n, vlong off)
 {
@@ -649,57 +2608,257 @@ bsread(Chan* c, void* a, long n, vlong off)
 			else
 				s = seprint(s, e, "%q, devtype %q\n", d->name, d->devtype);
 		}
+		s = seprint(s, e, "bounce buffers %d size %d bounces %lud bytes %llud waits %lud\n",
+			Nbounce, Bouncesize, bounce.nbounces, bounce.nbytes, bounce.nwaits);
+		s = seprint(s, e, "cache %d%% blocks %d max %d bytes %lld\n",
+			cache.pct, cache.nalloc, cache.max, (vlong)cache.nalloc*Cblksize);
 		n = readstr(off, a, n, buf);
 
-		poperror();
-		runlock(&bs);
+		poperror();
+		runlock(&bs);
+
+		poperror();
+		free(buf);
+		break;
+
+	case Qbsevent:
+	case Qdiskevent:
+		n = qread(((Evq*)c->aux)->q, a, n);
+		break;
+
+	case Qdiskctl:
+	case Qdiskdevctl:
+	case Qdiskstats:
+		n = bsdevread(c, a, n, off);
+		break;
+
+	case Qdiskpart:
+		n = bsdataio(c, 0, a, n, off);
+		break;
+
+	case Qdiskraw:
+		if(c->aux == nil)
+			error("no command executed");
+		b = c->aux;
+		if(off > b->n)
+			off = b->n;
+		if(off+n > b->n)
+			n = b->n-off;
+		memmove(a, b->a+off, n);
+		break;
+
+	default:
+		n = 0;
+		break;
+	}
+	return n;
+}
+
+enum {
+	CMinit, CMcache, CMsync,
+};
+static Cmdtab bsctl[] = {
+	CMinit,		"init",		2,
+	CMcache,	"cache",	2,
+	CMsync,		"sync",		1,
+};
+enum {
+	CMdiskinit, CMpartinit, CMsched, CMdiscard, CMflush, CMfua, CMreadahead, CMwriteback,
+};
+static Cmdtab bsdiskctl[] = {
+	CMdiskinit,	"init",		1,
+	CMpartinit,	"partinit",	1,
+	CMsched,	"sched",	0,
+	CMdiscard,	"discard",	0,
+	CMflush,	"flush",	1,
+	CMfua,		"fua",		2,
+	CMreadahead,	"readahead",	2,
+	CMwriteback,	"writeback",	0,
+};
+
+/*
+ * write dirty cached blocks, then the device cache to media.  stores
+ * without volatile cache have no flush.
+ */
+static void
+storeflush(Store *d)
+{
+	if(d->ready == 0)
+		error(Enodisk);
+	cacheflush(d, 1);
+	if(d->flush != nil)
+		d->flush(d);
+}
+
+/*
+ * flush the store of c, as barrier: writes that completed before are
+ * on media after.  d is only rlocked, like for io.
+ */
+static void
+bsflush(Chan *c)
+{
+	Store *d;
+	Part *p;
+
+	d = diskgetlock(QDISK(c->qid.path), Readlock);
+	if(waserror()) {
+		runlock(d);
+		nexterror();
+	}
+	if(c->qid.vers != d->vers)
+		error(Estale);
+	if(!iseve()) {
+		p = xpartget(d, QTYPE(c->qid.path) == Qdiskpart ? QPART(c->qid.path) : 0);
+		devpermcheck(p->uid, p->perm, OWRITE);
+	}
+	storeflush(d);
+	poperror();
+	runlock(d);
+}
+
+/* flush all ready stores, called with bs locked */
+static void
+bssync(void)
+{
+	Store *d;
+	int i;
+
+	for(i = 0; i <= bs.maxdisk; i++) {
+		d = diskget(i);
+		if(d == nil)
+			continue;
+		rlock(d);
+		if(waserror()) {
+			runlock(d);
+			nexterror();
+		}
+		if(d->ready)
+			storeflush(d);
+		poperror();
+		runlock(d);
+	}
+}
+
+/*
+ * write back dirty blocks at reboot.  only possible when called
+ * from a process, not after a panic.
+ */
+static void
+bsshutdown(void)
+{
+	if(up == nil)
+		return;
+	rlock(&bs);
+	if(waserror())
+		print("bs: sync at shutdown: %s\n", up->env->errstr);
+	else {
+		bssync();
+		poperror();
+	}
+	runlock(&bs);
+}
+
+static int
+rangecmp(void *a, void *b)
+{
+	Bsrange *x, *y;
+
+	x = a;
+	y = b;
+	if(x->off < y->off)
+		return -1;
+	return x->off > y->off;
+}
+
+/* sort ranges, merge overlapping and adjacent ones.  returns new count. */
+static int
+rangecoalesce(Bsrange *r, int nr)
+{
+	int i, n;
+
+	if(nr == 0)
+		return 0;
+	qsort(r, nr, sizeof r[0], rangecmp);
+	n = 0;
+	for(i = 1; i < nr; i++) {
+		if(r[i].off <= r[n].off+r[n].n) {
+			if(r[i].off+r[i].n > r[n].off+r[n].n)
+				r[n].n = r[i].off+r[i].n-r[n].off;
+		} else
+			r[++n] = r[i];
+	}
+	return n+1;
+}
+
+/*
+ * "discard part off n ...", tell the device the ranges of partition
+ * part no longer hold data.  d is only rlocked, discarding can take
+ * a while and io can continue meanwhile.
+ */
+static void
+bsdiscard(Chan *c, Cmdbuf *cb)
+{
+	Store *d;
+	Part *p;
+	Bsrange *r;
+	vlong off, n;
+	int i, nr;
 
-		poperror();
-		free(buf);
-		break;
+	if(cb->nf < 4 || cb->nf % 2 != 0)
+		error(Ebadarg);
 
-	case Qbsevent:
-		error("not yet");
-	case Qdiskctl:
-	case Qdiskdevctl:
-	case Qdiskpart:
-		n = bsdevread(c, a, n, off);
-		break;
+	d = diskgetlock(QDISK(c->qid.path), Readlock);
+	if(waserror()) {
+		runlock(d);
+		nexterror();
+	}
 
-	case Qdiskevent:
-		error("not yet");
+	if(c->qid.vers != d->vers)
+		error(Estale);
+	if(d->ready == 0)
+		error(Enodisk);
+	if(d->discard == nil)
+		error("discard not supported by device");
 
-	case Qdiskraw:
-		if(c->aux == nil)
-			error("no command executed");
-		b = c->aux;
-		if(off > b->n)
-			off = b->n;
-		if(off+n > b->n)
-			n = b->n-off;
-		memmove(a, b->a+off, n);
-		break;
+	p = nil;
+	for(i = 0; i < d->nparts; i++)
+		if(strcmp(d->parts[i].name, cb->f[1]) == 0)
+			p = &d->parts[i];
+	if(p == nil)
+		error(Enopart);
+	if(!iseve())
+		devpermcheck(p->uid, p->perm, OWRITE);
 
-	default:
-		n = 0;
-		break;
+	r = smalloc((cb->nf-2)/2*sizeof r[0]);
+	if(waserror()) {
+		free(r);
+		nexterror();
 	}
-	return n;
-}
+	nr = 0;
+	for(i = 2; i < cb->nf; i += 2) {
+		off = strtoll(cb->f[i], nil, 0);
+		n = strtoll(cb->f[i+1], nil, 0);
+		if(off < 0 || n < 0 || off > p->size || n > p->size-off)
+			error(Ebadarg);
+		if(off&d->alignmask || n&d->alignmask)
+			error(Ebadalign);
+		if(n == 0)
+			continue;
+		r[nr].off = p->s+off;
+		r[nr].n = n;
+		nr++;
+	}
+	nr = rangecoalesce(r, nr);
+	if(nr > 0)
+		d->discard(d, r, nr);
+	for(i = 0; i < nr; i++)
+		cacheinval(d, r[i].off, r[i].n);
+	poperror();
+	free(r);
 
-enum {
-	CMinit,
-};
-static Cmdtab bsctl[] = {
-	CMinit,		"init",		2,
-};
-enum {
-	CMdiskinit, CMpartinit,
-};
-static Cmdtab bsdiskctl[] = {
-	CMdiskinit,	"init",		1,
-	CMpartinit,	"partinit",	1,
-};
+	poperror();
+	runlock(d);
+}
 
 static long
 bsdevwrite(Chan* c, void* a, long n, vlong off)
@@ -747,15 +2906,14 @@ bsdevwrite(Chan* c, void* a, long n, vlong off)
 		else
 			c->aux = b = smalloc(sizeof b[0]);
 		b->a = nil;
+		cacheflush(d, 1);
 		b->n = d->raw(d, a, n, off, &b->a);
 		if(b->n < 0)
 			n = b->n;
+		/* raw commands may write anything */
+		cachepurge(d);
 		break;
 
-	case Qdiskpart:
-		p = xpartget(d, QPART(c->qid.path));
-		n = io(d, p, 1, a, n, off);
-		break;
 	}
 
 	poperror();
@@ -804,6 +2962,15 @@ bswrite(Chan* c, void* a, long n, vlong off)
 			poperror();
 			wunlock(d);
 			break;
+
+		case CMsync:
+			bssync();
+			break;
+
+		case CMcache:
+			/* percentage of memory for the block cache, 0 turns it off */
+			cacheset(atoi(cb->f[1]));
+			break;
 		}
 		poperror();
 		free(cb);
@@ -812,10 +2979,23 @@ bswrite(Chan* c, void* a, long n, vlong off)
 		wunlock(&bs);
 		break;
 
-	case Qbsevent:
-		error("not yet");
-
 	case Qdiskctl:
+		cb = parsecmd(a, n);
+		if(waserror()) {
+			free(cb);
+			nexterror();
+		}
+		ct = lookupcmd(cb, bsdiskctl, nelem(bsdiskctl));
+		if(ct->index == CMdiscard || ct->index == CMflush) {
+			if(ct->index == CMdiscard)
+				bsdiscard(c, cb);
+			else
+				bsflush(c);
+			poperror();
+			free(cb);
+			break;
+		}
+
 		wlock(&bs);
 		if(waserror()) {
 			wunlock(&bs);
@@ -839,12 +3019,6 @@ bswrite(Chan* c, void* a, long n, vlong off)
 			devpermcheck(p->uid, p->perm, OWRITE);
 		}
 
-		cb = parsecmd(a, n);
-		if(waserror()) {
-			free(cb);
-			nexterror();
-		}
-		ct = lookupcmd(cb, bsdiskctl, nelem(bsdiskctl));
 		switch(ct->index) {
 		case CMdiskinit:
 			diskinit(d);
@@ -854,28 +3028,77 @@ bswrite(Chan* c, void* a, long n, vlong off)
 			if(d->ready == 0)
 				error(Enodisk);
 
+			/* no new writes while the dirty blocks are written */
+			snappublish(d, 0);
+			if(waserror()) {
+				snappublish(d, 1);
+				nexterror();
+			}
+			cacheflush(d, 1);
 			d->parts = realloc(d->parts, sizeof d->parts[0]);
 			d->nparts = 1;
 			d->vers++;
+			cachepurge(d);
 			d->nparts = partinit(d->io, d, d->size, &d->parts);
+			pstatsinit(d);
+			poperror();
+			snappublish(d, 1);
+			bspost(d, "part %s %d\n", d->name, d->nparts-1);
+			break;
+
+		case CMsched:
+			if(cb->nf != 2 && cb->nf != 3)
+				error(Ebadarg);
+			schedset(d->sched, cb->f[1], cb->nf == 3 ? cb->f[2] : nil);
+			break;
+
+		case CMfua:
+			/* all writes through devbs with forced unit access */
+			if(strcmp(cb->f[1], "on") == 0)
+				d->sched->wflags |= Bfua;
+			else if(strcmp(cb->f[1], "off") == 0)
+				d->sched->wflags &= ~Bfua;
+			else
+				error(Ebadarg);
+			break;
+
+		case CMreadahead:
+			/* maximum read-ahead window in bytes, 0 turns it off */
+			num = atoi(cb->f[1]);
+			if(num < 0 || num > Maxreadahead)
+				error(Ebadarg);
+			d->cache->ramax = num;
+			break;
+
+		case CMwriteback:
+			/* writeback on|off [dirtylimit] */
+			if(cb->nf != 2 && cb->nf != 3)
+				error(Ebadarg);
+			if(strcmp(cb->f[1], "on") != 0 && strcmp(cb->f[1], "off") != 0)
+				error(Ebadarg);
+			writeback(d, strcmp(cb->f[1], "on") == 0, cb->nf == 3 ? cb->f[2] : nil);
 			break;
 		}
-		poperror();
-		free(cb);
 
 		poperror();
 		wunlock(d);
 
 		poperror();
 		wunlock(&bs);
+
+		poperror();
+		free(cb);
 		break;
 
 	case Qdiskdevctl:
 	case Qdiskraw:
-	case Qdiskpart:
 		n = bsdevwrite(c, a, n, off);
 		break;
 
+	case Qdiskpart:
+		n = bsdataio(c, 1, a, n, off);
+		break;
+
 	default:
 		error(Ebadusefd);
 	}
@@ -888,7 +3111,7 @@ Dev bsdevtab = {
 
 	bsreset,
 	bsinit,
-	devshutdown,
+	bsshutdown,
 	bsattach,
 	bswalk,
 	bsstat,
@@ -921,6 +3144,312 @@ blockstoreadd(Store *d)
 	}
 		
 	bs.disks[d->num] = d;
+	d->sched = schedalloc(d);
+	d->snap = malloc(sizeof d->snap[0]);
+	if(d->snap == nil)
+		panic("no memory");
+	d->cache = malloc(sizeof d->cache[0]);
+	if(d->cache == nil)
+		panic("no memory");
+	d->cache->ramax = Ramax;
+	d->cache->dirtymax = Dirtymax/Cblksize;
 	snprint(d->name, sizeof d->name, "bs%02d", d->num);
 	wunlock(&bs);
 }
+
+/*
+ * store by name, e.g. "bs01", for stores built on other stores.  nil
+ * if absent.  stores are only added during boot and never removed,
+ * so bs need not be locked.
+ */
+Store*
+blockstorelookup(char *name)
+{
+	char *p;
+	int num;
+
+	if(strncmp(name, "bs", 2) != 0)
+		return nil;
+	num = strtol(name+2, &p, 10);
+	if(p == name+2 || *p != 0)
+		return nil;
+	return diskget(num);
+}
+
+/*
+ * claim d for owner, a store built on it.  the owner does its i/o
+ * with bssubmit, past the cache of d.  dirty blocks of d are written
+ * and its cache dropped, open data and partition files go stale and
+ * new opens fail, or with rdonly only allow reading.  reads of a
+ * claimed store bypass the cache, the owner may change it.
+ */
+void
+bsclaim(Store *d, Store *owner, int rdonly)
+{
+	wlock(d);
+	if(waserror()) {
+		wunlock(d);
+		nexterror();
+	}
+	if(d->owner != nil) {
+		snprint(up->genbuf, sizeof up->genbuf, "%s in use by %s", d->name, d->owner->name);
+		error(up->genbuf);
+	}
+	if(d->ready == 0)
+		error(Enodisk);
+
+	snappublish(d, 0);
+	if(waserror()) {
+		snappublish(d, 1);
+		nexterror();
+	}
+	cacheflush(d, 1);
+	poperror();
+	d->owner = owner;
+	d->ownerrdonly = rdonly;
+	d->vers++;
+	cachepurge(d);
+	snappublish(d, 1);
+
+	poperror();
+	wunlock(d);
+}
+
+/* release claim of bsclaim, e.g. when creating the owner failed */
+void
+bsunclaim(Store *d)
+{
+	wlock(d);
+	d->owner = nil;
+	wunlock(d);
+}
+
+/*
+ * write all dirty blocks of d, for stores that change what their
+ * data is, e.g. a snapshot.  called with d rlocked, from its wctl.
+ */
+void
+bscacheflush(Store *d)
+{
+	cacheflush(d, 1);
+}
+
+static int
+isreqdone(void *p)
+{
+	return ((Bsreq*)p)->done;
+}
+
+/*
+ * start asynchronous i/o on d.  stores without submit do the i/o
+ * synchronously, the request is done when bssubmit returns.
+ * errors in the request itself (e.g. bad offset) may be raised
+ * directly, the request has not been started then.
+ */
+void
+bssubmit(Store *d, Bsreq *r)
+{
+	long n;
+
+	r->done = 0;
+	r->r = 0;
+	r->err[0] = 0;
+	r->npending = 0;
+	if(d->submit != nil) {
+		d->submit(d, r);
+		return;
+	}
+
+	if(waserror()) {
+		bsreqdone(r, 0, up->env->errstr);
+		return;
+	}
+	n = d->io(d, r->iswrite, r->buf, r->n, r->off);
+	poperror();
+	bsreqdone(r, n, nil);
+}
+
+/* wait for request started without completion function, raise its error */
+long
+bswait(Bsreq *r)
+{
+	/* the store is still using the buffer, we cannot leave before it is done */
+	while(waserror())
+		{}
+	sleep(r, isreqdone, r);
+	poperror();
+
+	if(r->err[0] != 0)
+		error(r->err);
+	return r->r;
+}
+
+/*
+ * called by stores when a request has finished, err is nil on success.
+ * a waiter in bswait may return as soon as it sees done, and r is
+ * usually on its stack: done is set and the waiter woken with
+ * interrupts off, so we cannot be preempted in between and touch r
+ * after it has gone (uniprocessor, like Snap).
+ */
+void
+bsreqdone(Bsreq *r, long n, char *err)
+{
+	int x;
+
+	r->r = n;
+	if(err != nil && *err != 0)
+		kstrcpy(r->err, err, sizeof r->err);
+	if(r->complete != nil) {
+		r->done = 1;
+		r->complete(r);
+		return;
+	}
+	x = splhi();
+	r->done = 1;
+	wakeup(r);
+	splx(x);
+}
+
+static int
+bouncefree(void*)
+{
+	return bounce.nfree > 0;
+}
+
+static uchar*
+bounceget(void)
+{
+	uchar *b;
+
+	for(;;) {
+		lock(&bounce);
+		if(bounce.nfree > 0)
+			break;
+		bounce.nwaits++;
+		unlock(&bounce);
+		sleep(&bounce.r, bouncefree, nil);
+	}
+	b = bounce.free[--bounce.nfree];
+	bounce.nbounces++;
+	unlock(&bounce);
+	return b;
+}
+
+static void
+bounceput(uchar *b)
+{
+	lock(&bounce);
+	bounce.free[bounce.nfree++] = b;
+	unlock(&bounce);
+	wakeup(&bounce.r);
+}
+
+/*
+ * do i/o through a cache-line aligned bounce buffer, for stores
+ * whose dma cannot use buf.  io is called with the bounce buffer,
+ * in pieces of at most Bouncesize.  aligned buffers should be passed
+ * to io directly, they need no copy.
+ */
+long
+bsbounceio(long (*io)(void*, int, void*, long, vlong), void *d, int iswrite, void *buf, long n, vlong off)
+{
+	uchar *a, *b;
+	long h, nn, r;
+
+	a = buf;
+	b = bounceget();
+	if(waserror()) {
+		bounceput(b);
+		nexterror();
+	}
+	for(h = 0; h < n; h += r) {
+		nn = n-h;
+		if(nn > Bouncesize)
+			nn = Bouncesize;
+		if(iswrite)
+			memmove(b, a+h, nn);
+		r = io(d, iswrite, b, nn, off+h);
+		if(!iswrite)
+			memmove(a+h, b, r);
+		if(r < nn) {
+			h += r;
+			break;
+		}
+	}
+	poperror();
+	bounceput(b);
+
+	lock(&bounce);
+	bounce.nbytes += h;
+	unlock(&bounce);
+	return h;
+}
+
+static void
+readyproc(void *a)
+{
+	Store *d;
+
+	d = a;
+	wlock(d);
+	if(waserror()) {
+		wunlock(d);
+		bspost(d, "error %s %q\n", d->name, up->env->errstr);
+		return;
+	}
+	diskinit(d);
+	poperror();
+	wunlock(d);
+}
+
+/*
+ * called by a store when its device has become ready, e.g. after
+ * a disk has spun up or a card was inserted.  the store is
+ * initialised and its partitions read in a new process, so the
+ * caller is not held up by (or blocks) the i/o.  "ready" or
+ * "error" is posted to bsevent when done.
+ */
+void
+blockstoreready(Store *d)
+{
+	kproc("bsready", readyproc, d, 0);
+}
+
+/*
+ * called by a store when a device or card has been connected,
+ * before it can be used.  may be called from interrupt context.
+ */
+void
+blockstorearrive(Store *d)
+{
+	bspost(d, "arrive %s\n", d->name);
+}
+
+/*
+ * called by a store when its device or card has gone.  the store
+ * becomes not ready, open partition files go stale and cached data
+ * is dropped.  dirty blocks cannot be written anymore, their loss is
+ * posted as error.  must be called from process context, waits for
+ * i/o on the partitions to finish, so the store should fail new
+ * requests first.
+ */
+void
+blockstoregone(Store *d)
+{
+	char msg[64];
+	vlong lost;
+
+	wlock(d);
+	snappublish(d, 0);
+	d->ready = 0;
+	d->nparts = 0;
+	d->vers++;
+	lost = cachepurge(d);
+	wunlock(d);
+	bspost(d, "remove %s\n", d->name);
+	if(lost > 0) {
+		snprint(msg, sizeof msg, "%lld dirty bytes lost", lost);
+		print("%s: %s\n", d->name, msg);
+		bspost(d, "error %s %q\n", d->name, msg);
+	}
+}
@@ -3,8 +3,6 @@ first attempt at driver for the sata controller.
 kirkwood has two ports, on the sheevaplug with sata from newit only the second port is in use.
 
 todo:
-- keep track of supported features of ata drive.
-- non-ncq dma.
 - mark disk as invalid before doing identify.  make sure we check that disk is valid before operating on it.
 
 - better support for ata commands, reading status bits after command.
@@ -12,12 +10,8 @@ todo:
 - detect whether packet command is accepted.  try if packet commands work.
 - read ata/atapi signature in registers after reset?
 - look at dcache flushes around dma
-- interrupt coalescing
-- support for general ata commands, e.g. smart, security
-- use generic sd (or bs) interface (#S;  we need partitions)
 - lba24-only drives
 - abstract for multiple ports (add controller struct to functions)
-- in satainit(), only start the disk init, don't wait for it to be ready?  faster booting, seems it takes controller/disk some time to init after reset.
 
 for the future:
 - power management
@@ -33,6 +27,8 @@ for the future:
 #include	"../port/error.h"
 
 #include	"io.h"
+#include	"part.h"
+#include	"bs.h"
 
 static int satadebug = 0;
 #define diprint	if(satadebug)iprint
@@ -83,6 +79,29 @@ enum {
 	Endoftable	= 1<<31,
 };
 
+typedef struct Atadev Atadev;
+struct Atadev {
+	ushort	major;
+	ushort	minor;
+	ushort	cmdset[6];	/* words 83-87.  first three are for "supported", last three for "enabled". */
+	ushort	sectorflags;	/* word 106 */
+	uvlong	wwn;		/* world wide name, unique.  0 if not supported. */
+	ushort	sectorsize;	/* logical sector size */
+	ushort	satacap;
+	ushort	nvcachecap;
+	ulong	nvcachelblocks;	/* in logical blocks */
+	ushort	rpm;		/* 0 for unknown, 1 for non-rotating device, other for rpm */
+	ushort	dsm;		/* word 169, data set management support */
+	ushort	dsmmax;		/* word 105, max 512-byte blocks of ranges per dsm command, 0 for unknown */
+};
+
+/* Disk.mode, how data is transferred */
+enum {
+	Mncq,		/* edma with first-party dma (ncq) commands */
+	Mdma,		/* edma with non-queued dma commands */
+	Mpio,		/* register pio, without edma */
+};
+
 typedef struct Disk Disk;
 struct Disk
 {
@@ -91,6 +110,9 @@ struct Disk
 	char	firmware[8+1];
 	char	model[40+1];
 	uvlong	sectors;
+	Atadev	dev;		/* capabilities & features, from identify */
+	int	mode;
+	int	multi;		/* sectors per drq block for Mpio */
 };
 
 /*
@@ -102,11 +124,25 @@ static uchar tags[32];
 static int tagnext;
 static int tagsinuse;
 static int ntags;
+static Lock tagl;	/* for tags, tagnext, tagsinuse, Tagio.r, Bsreq.npending.  ilock */
 static Rendez tagr;	/* protected by reqsl */
 
-static Rendez reqsr[32];	/* protected by requiring to hold tag */
-static volatile ulong reqsdone[32];
+/* what a tag in use is doing, kept for resubmitting after an ncq error */
+typedef struct Tagio Tagio;
+struct Tagio
+{
+	Bsreq	*r;		/* request this is part of, nil when tag is free */
+	ulong	ticks;		/* m->ticks at submit, for timeouts */
+	int	t;		/* Read or Write */
+	uchar	*buf;
+	ulong	ns;
+	uvlong	lba;
+	int	retries;
+};
+static Tagio tagios[32];
 static QLock reqsl;
+static volatile int recovering;	/* edma stopped after device error, set in intr, cleared in satarecover and satastartreset */
+static int nonqueued;		/* non-ncq command on edma, running alone */
 
 static volatile ulong atadone;	/* whether ata interrupt has occurred */
 static Rendez atadoner;
@@ -114,7 +150,7 @@ static Rendez atadoner;
 static volatile ulong ataregs;	/* registers received from device */
 static Rendez ataregsr;
 
-/* for reqsdone and atadone */
+/* for tagdone and atadone */
 enum {
 	Rok,
 	Rtimeout,
@@ -128,8 +164,26 @@ static char *donemsgs[] = {
 
 static struct {
 	ulong	serrorintrs;
+	ulong	doneintrs;	/* interrupts for completed edma requests */
+	ulong	ndone;		/* completed edma requests */
+	ulong	deverrs;	/* device errors during edma */
+	ulong	retries;	/* requests resubmitted after an error of another request */
+	ulong	nreqs;		/* edma requests submitted */
+	ulong	nbatches;	/* batches of requests submitted together */
+	uvlong	depthsum;	/* sum of tags in use after each submit, for average queue depth */
+	int	maxdepth;	/* highest number of tags in use */
 } stats;
 
+/* interrupt coalescing, set through ctl.  count 0 is off. */
+static struct {
+	int	count;	/* completions before interrupting */
+	int	usec;	/* or time since first completion */
+} coal;
+
+static Store satastore;
+static void satarecover(void);
+static long sataio(void*, int, void*, long, vlong);
+
 static Req *reqs;
 static Resp *resps;
 static Prd *prds;
@@ -143,6 +197,8 @@ static volatile ulong start;	/* how to start, see below */
 enum {
 	StartReset	= 1<<0,
 	StartIdentify	= 1<<1,
+	StartRecover	= 1<<2,
+	StartGone	= 1<<3,
 };
 
 
@@ -286,7 +342,7 @@ static Dirtab satadir[] = {
 static ulong
 g16(uchar *p)
 {
-	return ((ulong)p[0]<<8) | ((ulong)p[1]<<0);
+	return ((ulong)p[0]<<0) | ((ulong)p[1]<<8);
 }
 
 static int
@@ -326,24 +382,111 @@ satakick(ulong v)
 {
 	ilock(&startil);
 	diprint("satakick, v %#lux\n", v);
-	start = v;
+	start |= v;
 	wakeup(&startr);
 	iunlock(&startil);
 }
 
+/*
+ * enable main interrupts.  with coalescing, interrupt on coalesced
+ * completions instead of on each.  the per-port done interrupt also
+ * signals ata (non-edma) command completion, so it is on while doing those.
+ */
 static void
-sataabort(void)
+intrena(int ata)
 {
+	SatahcReg *hr = SATAHCREG;
+
+	if(coal.count == 0 || ata)
+		hr->intrmainena = Sata1err|Sata1done;
+	else
+		hr->intrmainena = Sata1err|Satacoaldone;
+}
+
+static void
+tagput(ulong tag)
+{
+	ilock(&tagl);
+	tags[(tagnext-tagsinuse+ntags) % ntags] = tag;
+	tagsinuse--;
+	iunlock(&tagl);
+	wakeup(&tagr);
+}
+
+/* drop a reference to r, complete it when it was the last */
+static void
+reqdone(Bsreq *r, int s)
+{
+	int last;
+
+	ilock(&tagl);
+	if(s != Rok && r->err[0] == 0)
+		strcpy(r->err, donemsgs[s]);
+	last = --r->npending == 0;
+	iunlock(&tagl);
+	if(last)
+		bsreqdone(r, r->err[0] != 0 ? 0 : r->r, nil);
+}
+
+/* request with tag has finished with status s, return the tag and complete its part of the request */
+static void
+tagdone(ulong tag, int s)
+{
+	Bsreq *r;
+
+	ilock(&tagl);
+	r = tagios[tag].r;
+	tagios[tag].r = nil;
+	iunlock(&tagl);
+	if(r == nil)
+		return;
+	tagput(tag);
+	reqdone(r, s);
+}
+
+/*
+ * stop edma and fail all outstanding requests with status s.
+ * the controller forgets about queued requests, so all tags are returned.
+ */
+static void
+sataabort(int s)
+{
+	SataReg *sr = SATA1REG;
 	int i;
 
-	for(i = 0; i < nelem(reqsr); i++) {
-		reqsdone[i] = Rfail;
-		wakeup(&reqsr[i]);
-	}
-	atadone = Rfail;
+	sr->edma.cmd = (sr->edma.cmd & ~EdmaEnable) | EdmaAbort;
+	sr->edma.reqout = sr->edma.reqin;
+	sr->edma.respin = sr->edma.respout;
+
+	for(i = 0; i < nelem(tagios); i++)
+		tagdone(i, s);
+	atadone = s;
 	wakeup(&atadoner);
+}
+
+/* complete the requests in the response queue */
+static void
+respdrain(void)
+{
+	SataReg *sr = SATA1REG;
+	ulong in, out, tag;
+
+	dcinv(resps, 32*sizeof resps[0]);
+	in = (sr->edma.respin & MASK(8))/sizeof (Resp);
+	out = (sr->edma.respout & MASK(8))/sizeof (Resp);
+	for(;;) {
+		if(in == out)
+			break;
 
-	/* xxx disable edma? */
+		/* determine which request is done, complete it. */
+		tag = resps[out].idflags & MASK(5);
+		/* errors are handled through Edeverr */
+
+		tagdone(tag, Rok);
+		stats.ndone++;
+		out = (out+1)%32;
+		sr->edma.respout = (ulong)&resps[out];
+	}
 }
 
 /*
@@ -359,8 +502,7 @@ sataintr(Ureg*, void*)
 {
 	SatahcReg *hr = SATAHCREG;
 	SataReg *sr = SATA1REG;
-	ulong v, e, tag;
-	ulong in, out;
+	ulong v, e;
 
 	v = hr->intrmain;
 	diprint("intr %#lux, main %#lux\n", hr->intr, v);
@@ -371,14 +513,23 @@ sataintr(Ureg*, void*)
 		e = sr->edma.intre;
 		if(e & (Edevdis | Eiordy | Elinkerrmask | Etransport)) {
 			/* unrecoverable error.  need ata reset to anything in future. */
-			sataabort();
-			/* xxx send hotplug disconnect event? */
-			satakick(StartReset);
+			sataabort(Rfail);
+			satakick(StartReset | ((e & Edevdis) ? StartGone : 0));
+		} else if(e & Edeverr && nonqueued) {
+			/* the failed command was the only one outstanding, no need to find out which */
+			diprint("Edeverr nonqueued\n");
+			stats.deverrs++;
+			sataabort(Rfail);
 		} else if(e & Edeverr) {
-			/* device to host fis, or set device bits fis received with ERR set.  during edma. */
-			/* xxx propagate error, how to recover? */
+			/*
+			 * device to host fis, or set device bits fis received with ERR set.  during edma.
+			 * stop edma, satarecover finds out which request failed and restarts the others.
+			 */
 			diprint("Edeverr\n");
-			sataabort();
+			stats.deverrs++;
+			recovering = 1;
+			sr->edma.cmd = (sr->edma.cmd & ~EdmaEnable) | EdmaAbort;
+			satakick(StartRecover);
 		}
 		if(e & Edevcon) {
 			/* device connected, hotplug */
@@ -391,11 +542,11 @@ sataintr(Ureg*, void*)
 			sr->ifc.serror = ~0UL;
 			stats.serrorintrs++;
 		}
-		if(e & Eselfdis) {
+		if((e & Eselfdis) && (e & Edeverr) == 0) {
 			/* edma disabled itself */
 			/* xxx how to recover?  at least stop all activity and return error. */
 			iprint("Eselfdis\n");
-			sataabort();
+			sataabort(Rfail);
 			satakick(StartReset);
 		}
 		if(e & Etransint) {
@@ -407,28 +558,15 @@ sataintr(Ureg*, void*)
 
 		sr->edma.intre = 0;
 	}
-	if(v & Sata1done) {
-		if(hr->intr & Idma1done) {
+	if(v & (Sata1done|Satacoaldone)) {
+		if(hr->intr & (Idma1done|Iintrcoalesc)) {
 			diprint("m 1dmadone\n");
 
-			hr->intr = ~Idma1done;
-
-			dcinv(resps, 32*sizeof resps[0]);
-			in = (sr->edma.respin & MASK(8))/sizeof (Resp);
-			out = (sr->edma.respout & MASK(8))/sizeof (Resp);
-			for(;;) {
-				if(in == out)
-					break;
+			/* with coalescing, several responses are waiting */
+			hr->intr = ~(Idma1done|Iintrcoalesc);
+			stats.doneintrs++;
 
-				/* determine which request is done, wakeup its caller. */
-				tag = resps[out].idflags & MASK(5);
-				/* xxx check for error in idflags?  we now handle error through Edeverr, and make all i/o fail... */
-
-				reqsdone[tag] = Rok;
-				wakeup(&reqsr[tag]);
-				out = (out+1)%32;
-				sr->edma.respout = (ulong)&resps[out];
-			}
+			respdrain();
 		}
 		if(hr->intr & Idevintr1) {
 			diprint("m 1ataintr\n");
@@ -450,10 +588,11 @@ pioget(uchar *p)
 	ulong v;
 	int i;
 
+	/* data as on disk, little endian 16-bit words */
 	for(i = 0; i < 256; i++) {
 		v = a->data;
-		*p++ = v>>8;
 		*p++ = v>>0;
+		*p++ = v>>8;
 	}
 }
 
@@ -465,8 +604,8 @@ pioput(uchar *p)
 	int i;
 
 	for(i = 0; i < 256; i++) {
-		v = (ulong)*p++<<8;
-		v |= (ulong)*p++<<0;
+		v = (ulong)*p++<<0;
+		v |= (ulong)*p++<<8;
 		a->data = v;
 	}
 }
@@ -536,6 +675,93 @@ atacmd(uchar cmd, uchar feat, uchar sectors, ulong lba, uchar dev, int dir, ucha
 	}
 }
 
+/* wait for the ata interrupt of a command, rearm for the next, return status */
+static ulong
+atastatus(int ms)
+{
+	tsleep(&atadoner, isdone, &atadone, ms);
+	if(atadone != Rok)
+		error(donemsgs[atadone]);
+	atadone = Rtimeout;
+	return ATA1REG->status;
+}
+
+/* as atastatus, but raise errors the command reported */
+static ulong
+ataintrwait(int ms)
+{
+	ulong v;
+
+	v = atastatus(ms);
+	if(v & Aerr)
+		error("ata command failed");
+	if(v & Adf)
+		error("device fault");
+	return v;
+}
+
+/*
+ * pio transfer of ns sectors at lba, with lba48 command cmd.
+ * data moves in drq blocks of multi sectors.  for reads the device
+ * interrupts when a block is ready.  for writes we poll for the first
+ * drq, the device interrupts after each block we wrote.
+ */
+static void
+atapio(uchar cmd, int dir, uchar *buf, ulong ns, uvlong lba, int multi)
+{
+	AtaReg *a = ATA1REG;
+	ulong v, nn;
+	int i;
+
+	atawait();
+
+	atadone = Rtimeout;
+	a->feat = 0;
+	a->sectors = ns>>8 & 0xff;
+	a->lbalow = lba>>24 & 0xff;
+	a->lbamid = lba>>32 & 0xff;
+	a->lbahigh = lba>>40 & 0xff;
+	a->feat = 0;
+	a->sectors = ns>>0 & 0xff;
+	a->lbalow = lba>>0 & 0xff;
+	a->lbamid = lba>>8 & 0xff;
+	a->lbahigh = lba>>16 & 0xff;
+	a->dev = 1<<6;
+	a->cmd = cmd;
+
+	if(dir == Host2dev) {
+		for(i = 0;; i++) {
+			v = a->status;
+			if(v & (Aerr|Adf))
+				error("ata command failed");
+			if((v & (Absy|Adrq)) == Adrq)
+				break;
+			if(i >= 5000)
+				error(Etimeout);
+			tsleep(&up->sleep, return0, nil, 1);
+		}
+	}
+
+	while(ns > 0) {
+		nn = min(ns, multi);
+		if(dir == Dev2host) {
+			v = ataintrwait(5*1000);
+			if((v & Adrq) == 0)
+				error("pio read: no data");
+		}
+		ns -= nn;
+		while(nn-- > 0) {
+			if(dir == Dev2host)
+				pioget(buf);
+			else
+				pioput(buf);
+			buf += 512;
+		}
+		if(dir == Host2dev)
+			ataintrwait(5*1000);
+	}
+}
+
 static int
 atacheck(ulong statusmask, ulong status)
 {
@@ -544,18 +770,26 @@ atacheck(ulong statusmask, ulong status)
 	return 0;
 }
 
-/* claim the sata controller.  must be called before doing ata commands, outside of edma. */
+/* wait for outstanding edma requests to finish, stop edma, keep others out */
 static void
-sataclaim(void)
+edmaidle(void)
 {
-	SataReg *sr = SATA1REG;
-
 	qlock(&reqsl);
 	do {
 		sleep(&tagr, tagsidle, nil);
 	} while(tagsinuse > 0);
 	SATA1REG->edma.cmd |= EdmaAbort;
+}
+
+/* claim the sata controller.  must be called before doing ata commands, outside of edma. */
+static void
+sataclaim(void)
+{
+	SataReg *sr = SATA1REG;
+
+	edmaidle();
 	sr->ifc.fisintrena |= 1<<0;
+	intrena(1);
 }
 
 static void
@@ -564,10 +798,25 @@ sataunclaim(void)
 	SataReg *sr = SATA1REG;
 
 	sr->ifc.fisintrena &= ~(1<<0);
+	intrena(0);
 	qunlock(&reqsl);
 }
 
 /* strip spaces in string.  at least western digital returns space-padded strings for "identify device". */
+/* identify strings have the first character in the high byte of each word */
+static void
+swapstr(char *p, int n)
+{
+	char c;
+	int i;
+
+	for(i = 0; i+1 < n; i += 2) {
+		c = p[i];
+		p[i] = p[i+1];
+		p[i+1] = c;
+	}
+}
+
 static void
 strip(char *p)
 {
@@ -610,6 +859,7 @@ enum {
 
 	/* ata commands supported (word 84), enabled (word 87) */
 	Feat2WWName64		= 1<<8,
+	Feat2FUA		= 1<<6,
 	Feat2Logging		= 1<<5,
 	Feat2SMARTselftest	= 1<<1,
 	Feat2SMARTerrorlog	= 1<<0,
@@ -624,6 +874,9 @@ enum {
 	SataCapGen2		= 1<<2,
 	SataCapGen1		= 1<<1,
 
+	/* data set management, word 169 */
+	DsmTrim			= 1<<0,
+
 	/* nvcache capabilities, word 214 */
 	NvcacheEnabled		= 1<<4,
 	NvcachePMEnabled	= 1<<1,
@@ -631,20 +884,6 @@ enum {
 };
 
 
-typedef struct Atadev Atadev;
-struct Atadev {
-	ushort	major;
-	ushort	minor;
-	ushort	cmdset[6];	/* words 83-87.  first three are for "supported", last three for "enabled". */
-	ushort	sectorflags;	/* word 106 */
-	uvlong	wwn;		/* world wide name, unique.  0 if not supported. */
-	ushort	sectorsize;	/* logical sector size */
-	ushort	satacap;
-	ushort	nvcachecap;
-	ulong	nvcachelblocks;	/* in logical blocks */
-	ushort	rpm;		/* 0 for unknown, 1 for non-rotating device, other for rpm */
-};
-
 
 static void
 identify(void)
@@ -652,7 +891,7 @@ identify(void)
 	uchar c;
 	uchar buf[512];
 	int i;
-	ushort w;
+	ushort w, caps;
 	Atadev dev;
 
 	atacmd(0xec, 0, 0, 0, 0, Dev2host, buf, 60*1000);
@@ -668,6 +907,9 @@ identify(void)
 	memmove(disk.serial, buf+10*2, sizeof disk.serial-1);
 	memmove(disk.firmware, buf+23*2, sizeof disk.firmware-1);
 	memmove(disk.model, buf+27*2, sizeof disk.model-1);
+	swapstr(disk.serial, sizeof disk.serial-1);
+	swapstr(disk.firmware, sizeof disk.firmware-1);
+	swapstr(disk.model, sizeof disk.model-1);
 	strip(disk.serial);
 	strip(disk.firmware);
 	strip(disk.model);
@@ -677,13 +919,9 @@ identify(void)
 	disk.sectors |= (uvlong)g16(buf+102*2)<<32;
 
 	w = g16(buf+49*2);
-	if((w & Fcapdma) == 0 || (w & Fcaplba) == 0)
-		error("disk does not support dma and/or lba");
-
-	w = g16(buf+75*2);
-	ntags = 1 + (w&MASK(5));
-	for(i = 0; i < ntags; i++)
-		tags[i] = i;
+	if((w & Fcaplba) == 0)
+		error("disk does not support lba");
+	caps = w;
 
 	dev.major = g16(buf+80*2);
 	dev.minor = g16(buf+81*2);
@@ -705,7 +943,7 @@ identify(void)
 	if((dev.sectorflags & Fvalidmask) != Fvalid)
 		dev.sectorflags = 0;
 	if(dev.sectorflags & LargeLogicalSectors)
-		dev.sectorsize = 2 * (g16(buf+117*2)<<16 | g16(buf+118*2)<<0);
+		dev.sectorsize = 2 * (g16(buf+118*2)<<16 | g16(buf+117*2)<<0);
 
 	dev.wwn = 0;
 	if((dev.cmdset[2] & Feat2WWName64) && (dev.cmdset[3+2] & Feat2WWName64))
@@ -718,11 +956,44 @@ identify(void)
 	dev.nvcachecap = g16(buf+214*2);
 	dev.nvcachelblocks = g16(buf+215*2)<<16 | g16(buf+216*2)<<0;
 
+	dev.dsm = g16(buf+169*2);
+	if(dev.dsm == 0xffff)
+		dev.dsm = 0;
+	dev.dsmmax = g16(buf+105*2);
+	if(dev.dsmmax == 0xffff)
+		dev.dsmmax = 0;
+
 	dev.rpm = g16(buf+217*2);
 	/* check for "reserved" range in ata8-acs, set to 0 unknown if so */
 	if(dev.rpm > 1 && dev.rpm < 0x400 || dev.rpm == 0xffff)
 		dev.rpm = 0;
 
+	/*
+	 * pick the best way to transfer data.  ncq if possible, then dma.
+	 * pio is the last resort, for bridges that do no dma at all.
+	 * only ncq gets more than one tag.
+	 */
+	ntags = 1;
+	disk.multi = 1;
+	if(dev.satacap & SataCapNCQ) {
+		disk.mode = Mncq;
+		ntags = 1 + (g16(buf+75*2)&MASK(5));
+	} else if(caps & Fcapdma)
+		disk.mode = Mdma;
+	else {
+		disk.mode = Mpio;
+		w = g16(buf+47*2) & 0xff;
+		if(w > 1 && !waserror()) {
+			atacmd(0xc6, 0, w, 0, 0, Nodata, nil, 5*1000);	/* set multiple mode */
+			poperror();
+			disk.multi = w;
+		}
+	}
+	for(i = 0; i < ntags; i++)
+		tags[i] = i;
+	tagnext = 0;
+	disk.dev = dev;
+
 if(satadebug) {
 	dprint("model %q\n", disk.model);
 	dprint("serial %q\n", disk.serial);
@@ -777,6 +1048,35 @@ flush(void)
 	sataunclaim();
 }
 
+/* whether writes can have forced unit access without flushing the whole cache */
+static int
+fuaok(void)
+{
+	return disk.mode == Mncq || disk.mode == Mdma && (disk.dev.cmdset[2] & Feat2FUA);
+}
+
+static void
+wcache(int on)
+{
+	sataclaim();
+	if(waserror()) {
+		sataunclaim();
+		nexterror();
+	}
+
+	/* set features, enable/disable write cache */
+	atacmd(0xef, on ? 0x02 : 0x82, 0, 0, 1<<6, Nodata, nil, 30*1000);
+	if(atacheck(Absy|Adrdy|Adf|Adrq|Aerr, Adrdy) < 0)
+		error("set features failed");
+	if(on)
+		disk.dev.cmdset[3] |= Feat0Writecache;
+	else
+		disk.dev.cmdset[3] &= ~Feat0Writecache;
+
+	poperror();
+	sataunclaim();
+}
+
 static void
 satareset(void)
 {
@@ -846,6 +1146,9 @@ if(0) {
 	reqnext = respnext = 0;
 
 	intrenable(Irqlo, IRQ0sata, sataintr, nil, "sata");
+
+	satastore.num = 1;
+	blockstoreadd(&satastore);
 }
 
 static void
@@ -855,6 +1158,17 @@ satastartreset(void)
 
 	diprint("before ata reset, sstatus %#lux\n", sr->ifc.sstatus);
 
+	/*
+	 * outstanding requests were aborted before the reset was kicked.
+	 * a recovery that did not run is void, forget the queue and let
+	 * reqkick start edma again.
+	 */
+	qlock(&reqsl);
+	sr->edma.reqin = sr->edma.reqout = (ulong)&reqs[reqnext];
+	sr->edma.respin = sr->edma.respout;
+	recovering = 0;
+	qunlock(&reqsl);
+
 	sr->edma.cmd |= Atareset;
 	regreadl(&sr->edma.cmd);
 	sr->edma.cmd &= ~Atareset;
@@ -886,9 +1200,25 @@ satastartreset(void)
 	/* have to find out if hotplug works for sata 1.x */
 }
 
+/*
+ * identify after a connect, or after a reset to recover from errors.
+ * in the latter case the disk is usually the same, and devbs must
+ * keep its cache and open files, so it is only told about new disks.
+ */
 static void
 satastartidentify(void)
 {
+	char serial[sizeof disk.serial];
+	uvlong sectors;
+	int wasvalid, secsize, same;
+
+	wasvalid = disk.valid;
+	strcpy(serial, disk.serial);
+	sectors = disk.sectors;
+	secsize = disk.dev.sectorsize;
+	if(!wasvalid)
+		blockstorearrive(&satastore);
+
 	sataclaim();
 	if(waserror()) {
 		sataunclaim();
@@ -898,11 +1228,44 @@ satastartidentify(void)
 	poperror();
 	sataunclaim();
 
+	same = wasvalid && strcmp(serial, disk.serial) == 0 && sectors == disk.sectors && secsize == disk.dev.sectorsize;
+	if(same && satastore.ready)
+		return;
+	/* another disk: dirty blocks of the old one must not be written to it */
+	if(wasvalid && !same)
+		blockstoregone(&satastore);
+
 	print("#S/sd01: %q, %lludGiB (%,llud bytes), %s Gb/s\n",
 		disk.model,
 		disk.sectors*512/(1024*1024*1024),
 		disk.sectors*512,
 		(SATA1REG->ifc.sstatus & SSPDgen2) ? "3.0" : "1.5");
+
+	/* let devbs read the partitions, in its own process */
+	blockstoreready(&satastore);
+}
+
+/* device disconnected.  fail new requests, then tell devbs. */
+static void
+satastartgone(void)
+{
+	if(disk.valid == 0)
+		return;
+	disk.valid = 0;
+	print("#S/sd01: disk removed\n");
+	blockstoregone(&satastore);
+}
+
+/* whether a request has been outstanding too long.  the device won't answer anymore. */
+static int
+tagstimedout(void)
+{
+	int i;
+
+	for(i = 0; i < nelem(tagios); i++)
+		if(tagios[i].r != nil && m->ticks-tagios[i].ticks >= MS2TK(60*1000))
+			return 1;
+	return 0;
 }
 
 static void
@@ -912,7 +1275,7 @@ satastart(void*)
 
 	for(;;) {
 		diprint("satastart sleep... start %#lux\n", start);
-		sleep(&startr, notzero, &start);
+		tsleep(&startr, notzero, &start, 1000);
 		diprint("satastart wakeup... start %#lux\n", start);
 
 		ilock(&startil);
@@ -920,7 +1283,17 @@ satastart(void*)
 		start = 0;
 		iunlock(&startil);
 
+		if(tagstimedout()) {
+			print("#S/sd01: request timed out, resetting\n");
+			sataabort(Rtimeout);
+			v |= StartReset;
+		}
+
 		if(!waserror()) {
+			if(v & StartGone)
+				satastartgone();
+			if(v & StartRecover)
+				satarecover();
 			if(v & StartReset)
 				satastartreset();
 			if(v & StartIdentify)
@@ -954,7 +1327,9 @@ satainit(void)
 	sr->edma.respout = (ulong)&resps[0];
 
 	/* clear & enable interrupts, to get "device connected" interrupts among others */
-	hr->intrmainena = Sata1err|Sata1done;
+	hr->intrcoalesc = coal.count;
+	hr->intrtime = US2TMR(coal.usec);
+	intrena(0);
 	hr->intr = 0;
 	sr->edma.intre = 0;
 	sr->edma.intreena = ~(0UL | Etxlinkmask<<Etxctlshift);
@@ -989,51 +1364,62 @@ prdfill(Prd *prd, uchar *buf, long n)
 }
 
 enum {
-	/* first param for io() */
+	/* first param for xfer() */
 	Read, Write,
+	Dsm,		/* data set management trim, for reqfill */
+	Writefua,	/* write with forced unit access, for reqfill */
+
+	Maxretries	= 3,		/* resubmits of a request after errors of other requests */
+	Maxcoalcount	= 255,
+	Maxcoalusec	= 10*1000,
+	Maxdsmblocks	= 8,		/* blocks of dsm ranges per command we send at most */
+
+	Maxreqsect	= 8*128,	/* sectors per edma request, 8 prds of 64k */
 };
+
+/* take a free tag for r.  caller must have checked tagfree(). */
 static ulong
-io(int t, void *buf, long nb, vlong off)
+tagget(Bsreq *r)
+{
+	ulong tag;
+
+	ilock(&tagl);
+	tag = tags[tagnext];
+	tagnext = (tagnext+1)%ntags;
+	tagsinuse++;
+	if(tagsinuse > stats.maxdepth)
+		stats.maxdepth = tagsinuse;
+	tagios[tag].r = r;
+	tagios[tag].ticks = m->ticks;
+	tagios[tag].retries = 0;
+	r->npending++;
+	iunlock(&tagl);
+	return tag;
+}
+
+/*
+ * fill the next request in the edma request queue.
+ * the request is not seen by the controller until reqin is updated.
+ * called with reqsl held.
+ */
+static void
+reqfill(int t, ulong tag, uchar *buf, ulong ns, uvlong lba)
 {
-	SatahcReg *hr = SATAHCREG;
-	SataReg *sr = SATA1REG;
 	Req *rq;
 	int i;
-	ulong tag;
-	ulong ns;
 	ulong dev;
 	ulong nslo, nshi;
-	uvlong lba;
 	ulong lbalo, lbahi;
-	ulong cmds[] = {0x60, 0x61}; /* xxx this is for sata fpdma only, ncq */
+	ulong ncqcmds[] = {0x60, 0x61, 0, 0x61};	/* read/write fpdma queued, by t */
+	ulong dmacmds[] = {0x25, 0x35, 0, 0x3d};	/* read/write dma ext, write dma fua ext */
 	Prd *prd;
-	char *msg;
-
-	if(disk.valid == 0)
-		error(Enodisk);
-
-	if(nb < 0 || off < 0 || off % 512 != 0)
-		error(Ebadarg);
-	ns = nb/512;
-	lba = off/512;
-	if(nb == 0)
-		return 0;
-	if(nb % 512 != 0)
-		error(Ebadarg);
-	if((ulong)buf & 1)
-		error(Ebadarg); /* fix, should alloc buffer and copy it afterwards? */
-
-	if(lba == disk.sectors)
-		return 0;
-	if(lba > disk.sectors)
-		error(Ebadarg);
-
-	qlock(&reqsl);
+	Tagio *tio;
 
-	sleep(&tagr, tagfree, nil);
-	tag = tags[tagnext];
-	tagnext = (tagnext+1)%ntags;
-	tagsinuse++;
+	tio = &tagios[tag];
+	tio->t = t;
+	tio->buf = buf;
+	tio->ns = ns;
+	tio->lba = lba;
 
 	i = reqnext;
 	rq = &reqs[i];
@@ -1041,9 +1427,7 @@ io(int t, void *buf, long nb, vlong off)
 
 	rq->prdhi = 0;
 	if(ns > 128) {
-		prd = &prds[i*8];
-		if(ns > 8*128)
-			ns = 8*128;
+		prd = &prds[tag*8];
 		prdfill(prd, buf, ns*512);
 		dcwb(prd, 8*sizeof prd[0]);
 		rq->prdlo = (ulong)prd;
@@ -1064,13 +1448,40 @@ io(int t, void *buf, long nb, vlong off)
 	nslo = ns>>0 & 0xff;
 	nshi = ns>>8 & 0xff;
 	dev = 1<<6;
-	rq->ata[0] = cmds[t]<<16 | nslo<<24;  /* cmd, feat current */
-	rq->ata[1] = lbalo<<0 | dev<<24;  /* 24 bit lba current, dev */
-	rq->ata[2] = lbahi<<0 | nshi<<24;  /* 24 bit lba previous, feat ext/previous */
-	rq->ata[3] = (tag<<3)<<0 | 0<<8;  /* sectors current (tag), previous */
+	if(t == Writefua && disk.mode == Mncq)
+		dev |= 1<<7;	/* fua */
+	if(t == Dsm) {
+		/* ns is the number of 512-byte blocks with ranges, lba is unused */
+		rq->ata[0] = 0x06<<16 | 0x01<<24;  /* cmd data set management, feat trim */
+		rq->ata[1] = 0<<0 | dev<<24;
+		rq->ata[2] = 0;
+		rq->ata[3] = nslo<<0 | nshi<<8;
+	} else if(disk.mode == Mncq) {
+		/* sector count goes in features, tag in sector count */
+		rq->ata[0] = ncqcmds[t]<<16 | nslo<<24;  /* cmd, feat current */
+		rq->ata[1] = lbalo<<0 | dev<<24;  /* 24 bit lba current, dev */
+		rq->ata[2] = lbahi<<0 | nshi<<24;  /* 24 bit lba previous, feat ext/previous */
+		rq->ata[3] = (tag<<3)<<0 | 0<<8;  /* sectors current (tag), previous */
+	} else {
+		rq->ata[0] = dmacmds[t]<<16 | 0<<24;
+		rq->ata[1] = lbalo<<0 | dev<<24;
+		rq->ata[2] = lbahi<<0 | 0<<24;
+		rq->ata[3] = nslo<<0 | nshi<<8;
+	}
 	dcwbinv(rq, sizeof rq[0]);
+}
+
+/* hand filled requests to the controller, enabling edma if needed.  called with reqsl held. */
+static void
+reqkick(void)
+{
+	SatahcReg *hr = SATAHCREG;
+	SataReg *sr = SATA1REG;
+
+	/* satarecover will resubmit everything */
+	if(recovering)
+		return;
 
-	reqsdone[tag] = Rtimeout;
 	sr->edma.reqin = (ulong)&reqs[reqnext];
 	if((sr->edma.cmd & EdmaEnable) == 0) {
 		/* xxx check for bsy in ata status register? */
@@ -1078,29 +1489,581 @@ io(int t, void *buf, long nb, vlong off)
 		sr->edma.intre = 0;
 		hr->intr = ~(Sata1err|Sata1done);
 
-		sr->edma.cfg = (sr->edma.cfg & ~ECFGqueue) | ECFGncq;
+		sr->edma.cfg &= ~(ECFGqueue|ECFGncq);
+		if(disk.mode == Mncq && !nonqueued)
+			sr->edma.cfg |= ECFGncq;
 
 		sr->ifc.fisintr = 0;
 
 		sr->edma.cmd = EdmaEnable;
 		regreadl(&sr->edma.cmd);
 	}
+	stats.nbatches++;
+}
+
+/*
+ * called by satastart after a device error during edma.  edma has been stopped.
+ * with ncq the device aborts all outstanding commands after an error.  the ncq
+ * error log tells us which one failed.  we fail only that one and resubmit the
+ * others.  if we cannot tell which request failed, all fail.
+ */
+static void
+satarecover(void)
+{
+	SataReg *sr = SATA1REG;
+	uchar *buf;
+	int i, bad, s;
+	Tagio *tio;
+
+	qlock(&reqsl);
+	if(waserror()) {
+		qunlock(&reqsl);
+		nexterror();
+	}
+
+	/* process responses that came in before edma stopped */
+	s = splhi();
+	respdrain();
+	splx(s);
+
+	/* forget about the queue, including requests filled while recovering.  we fill it again below. */
+	sr->edma.reqin = sr->edma.reqout = (ulong)&reqs[reqnext];
+	sr->edma.respin = sr->edma.respout;
+
+	bad = -1;
+	if(disk.mode == Mncq) {
+		buf = smalloc(512);
+		sr->ifc.fisintrena |= 1<<0;
+		intrena(1);
+		if(!waserror()) {
+			/* read log ext, ncq command error log */
+			atapio(0x2f, Dev2host, buf, 1, 0x10, 1);
+			poperror();
+			if((buf[0] & 1<<7) == 0)
+				bad = buf[0] & MASK(5);
+			diprint("ncq error log, tag %d, status %#ux, error %#ux\n", bad, buf[2], buf[3]);
+		}
+		sr->ifc.fisintrena &= ~(1<<0);
+		intrena(0);
+		free(buf);
+	} else {
+		/* without ncq only one request can be outstanding */
+		for(i = 0; i < ntags; i++)
+			if(tagios[tags[i]].r != nil)
+				bad = tags[i];
+	}
+
+	if(bad < 0 || tagios[bad].r == nil) {
+		print("#S/sd01: cannot determine failed request, failing all\n");
+		sataabort(Rfail);
+		recovering = 0;
+	} else {
+		tagdone(bad, Rfail);
+		recovering = 0;
+		for(i = 0; i < nelem(tagios); i++) {
+			tio = &tagios[i];
+			if(tio->r == nil)
+				continue;
+			if(tio->retries++ >= Maxretries) {
+				tagdone(i, Rfail);
+				continue;
+			}
+			reqfill(tio->t, i, tio->buf, tio->ns, tio->lba);
+			tio->ticks = m->ticks;
+			stats.retries++;
+		}
+		reqkick();
+	}
+
+	poperror();
 	qunlock(&reqsl);
+}
+
+/* pio is done synchronously, with edma off */
+static void
+piosubmit(Bsreq *r, uchar *buf, ulong ns, uvlong lba)
+{
+	uchar cmds[2][2] = {
+		{0x24, 0x34},	/* read/write sectors ext */
+		{0x29, 0x39},	/* read/write multiple ext */
+	};
+	uchar cmd;
+	ulong nn;
+	long n;
+
+	cmd = cmds[disk.multi > 1][r->iswrite];
+	n = 0;
+	sataclaim();
+	if(waserror()) {
+		sataunclaim();
+		bsreqdone(r, 0, up->env->errstr);
+		return;
+	}
+	while(ns > 0) {
+		nn = ns;
+		if(nn > 256)
+			nn = 256;
+		atapio(cmd, r->iswrite ? Host2dev : Dev2host, buf, nn, lba, disk.multi);
+		stats.nreqs++;
+		buf += nn*512;
+		lba += nn;
+		ns -= nn;
+		n += nn*512;
+	}
+	poperror();
+	sataunclaim();
+	bsreqdone(r, n, nil);
+}
+
+/*
+ * start i/o for r.  large transfers are split in requests of at most
+ * Maxreqsect sectors, each with their own ncq tag, so the drive can work
+ * on them concurrently.  requests are handed to the controller together,
+ * when we run out of tags or have queued the whole transfer.
+ * tags are returned from the interrupt handler, or by satastart after
+ * errors or timeouts.  satarecover needs reqsl, so we do not hold it
+ * while waiting for a tag.  r completes when all its requests have.
+ */
+static void
+satasubmit(Store*, Bsreq *r)
+{
+	uchar *buf;
+	ulong ns, nn, tag;
+	uvlong lba;
+	long n;
+	int fua, locked;
 
-	/* xxx have to return tag on interrupt? */
-	tsleep(&reqsr[tag], isdone, &reqsdone[tag], 60*1000);
+	if(disk.valid == 0)
+		error(Enodisk);
 
-	if(reqsdone[tag] != Rok) {
-		/* xxx should do ata reset, or return the tag back to pool */
-		msg = donemsgs[reqsdone[tag]];
-		error(msg);
+	buf = r->buf;
+	if(r->n < 0 || r->off < 0 || r->off % 512 != 0)
+		error(Ebadarg);
+	if(r->n % 512 != 0)
+		error(Ebadarg);
+	fua = r->iswrite && (r->flags & Bfua);
+	if((ulong)buf & 1 || fua && !fuaok()) {
+		/*
+		 * prd addresses must be 2-byte aligned, pio does 16-bit accesses.
+		 * without fua command, write and flush the cache after.
+		 */
+		if(waserror()) {
+			bsreqdone(r, 0, up->env->errstr);
+			return;
+		}
+		if((ulong)buf & 1)
+			n = bsbounceio(sataio, nil, r->iswrite, buf, r->n, r->off);
+		else
+			n = sataio(nil, r->iswrite, buf, r->n, r->off);
+		if(fua)
+			flush();
+		poperror();
+		bsreqdone(r, n, nil);
+		return;
 	}
 
-	tags[(tagnext-tagsinuse+ntags) % ntags] = tag;
-	tagsinuse--;
-	wakeup(&tagr);
+	lba = r->off/512;
+	if(lba > disk.sectors)
+		error(Ebadarg);
+	ns = r->n/512;
+	if(ns > disk.sectors-lba)
+		ns = disk.sectors-lba;
+
+	if(disk.mode == Mpio) {
+		piosubmit(r, buf, ns, lba);
+		return;
+	}
+
+	dcwbinv(buf, ns*512);
+	r->r = ns*512;
+	r->npending = 1;	/* for ourselves, until all is submitted */
+
+	qlock(&reqsl);
+	locked = 1;
+	if(waserror()) {
+		/* parts already submitted complete by themselves, r with our error */
+		if(locked)
+			qunlock(&reqsl);
+		kstrcpy(r->err, up->env->errstr, sizeof r->err);
+		reqdone(r, Rfail);
+		return;
+	}
+	while(ns > 0) {
+		while(!tagfree(nil)) {
+			qunlock(&reqsl);
+			locked = 0;
+			sleep(&tagr, tagfree, nil);
+			qlock(&reqsl);
+			locked = 1;
+		}
+		nn = ns;
+		if(nn > Maxreqsect)
+			nn = Maxreqsect;
+		tag = tagget(r);
+		reqfill(fua ? Writefua : r->iswrite ? Write : Read, tag, buf, nn, lba);
+		stats.nreqs++;
+		stats.depthsum += tagsinuse;
+		buf += nn*512;
+		lba += nn;
+		ns -= nn;
+		if(ns == 0 || !tagfree(nil))
+			reqkick();
+	}
+	poperror();
+	qunlock(&reqsl);
+
+	reqdone(r, Rok);
+}
+
+/*
+ * data set management is a non-queued dma command.  with ncq, edma
+ * is stopped and restarted in non-ncq mode for it, and again after.
+ */
+static void
+dsmtrim(uchar *buf, ulong nblocks)
+{
+	Bsreq r;
+	ulong tag;
+
+	memset(&r, 0, sizeof r);
+	dcwbinv(buf, nblocks*512);
+	edmaidle();
+	if(waserror()) {
+		SATA1REG->edma.cmd |= EdmaAbort;
+		nonqueued = 0;
+		qunlock(&reqsl);
+		nexterror();
+	}
+	nonqueued = 1;
+	r.npending = 1;
+	tag = tagget(&r);
+	reqfill(Dsm, tag, buf, nblocks, 0);
+	reqkick();
+	reqdone(&r, Rok);
+	bswait(&r);
+
+	SATA1REG->edma.cmd |= EdmaAbort;
+	nonqueued = 0;
+	poperror();
+	qunlock(&reqsl);
+}
+
+/*
+ * trim ranges.  each 512-byte block of the dsm data holds 64 entries
+ * of a 48-bit lba and 16-bit sector count.  the disk says how many
+ * blocks it takes per command.
+ */
+static void
+satadiscard(Store*, Bsrange *r, int nr)
+{
+	uchar *buf, *p;
+	ulong ns, max;
+	uvlong lba, n;
+	int i, ne;
+
+	if(disk.valid == 0)
+		error(Enodisk);
+	if((disk.dev.dsm & DsmTrim) == 0)
+		error("disk does not support trim");
+	if(disk.mode == Mpio)
+		error("trim needs dma");
+
+	max = disk.dev.dsmmax;
+	if(max == 0)
+		max = 1;
+	if(max > Maxdsmblocks)
+		max = Maxdsmblocks;
+	buf = smalloc(max*512);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	ne = 0;
+	for(i = 0; i < nr; i++) {
+		lba = r[i].off/512;
+		n = r[i].n/512;
+		if(lba > disk.sectors || n > disk.sectors-lba)
+			error(Ebadarg);
+		while(n > 0) {
+			ns = n;
+			if(ns > 0xffff)
+				ns = 0xffff;
+			p = buf+ne*8;
+			p[0] = lba>>0;
+			p[1] = lba>>8;
+			p[2] = lba>>16;
+			p[3] = lba>>24;
+			p[4] = lba>>32;
+			p[5] = lba>>40;
+			p[6] = ns>>0;
+			p[7] = ns>>8;
+			lba += ns;
+			n -= ns;
+			if(++ne == max*64) {
+				dsmtrim(buf, max);
+				memset(buf, 0, max*512);
+				ne = 0;
+			}
+		}
+	}
+	if(ne > 0)
+		dsmtrim(buf, (ne+63)/64);
+	poperror();
+	free(buf);
+}
+
+enum {
+	/* raw command protocols */
+	Rawnodata, Rawpioin, Rawpioout,
+
+	Rawhdr		= 16,
+	Maxrawsect	= 128,
+};
+
+/*
+ * ata command passthrough, for the raw file.  the command is a
+ * block of Rawhdr bytes, followed by the data for data-out commands:
+ *	0	protocol: 0 non-data, 1 pio data-in, 2 pio data-out
+ *	1	command
+ *	2-3	features, features exp
+ *	4-5	count, little endian
+ *	6-11	lba, little endian
+ *	12	device
+ * the taskfile is always written as for lba48, 28-bit commands ignore
+ * the exp registers.  data moves in drq blocks of one sector, count is
+ * the number of sectors.  the response is a block of Rawhdr bytes with
+ * the resulting registers:
+ *	0	status
+ *	1	error
+ *	2-3	count
+ *	4-9	lba
+ *	10	device
+ * followed by the data read.  a command that fails still returns its
+ * registers, e.g. for smart return status.
+ */
+static long
+sataraw(Store*, void *a, long n, vlong off, void **rp)
+{
+	AtaReg *ar = ATA1REG;
+	uchar *c, *r, *p;
+	int proto, i;
+	ulong ns, v;
 
-	return ns*512;
+	if(disk.valid == 0)
+		error(Enodisk);
+	if(off != 0 || n < Rawhdr)
+		error(Ebadarg);
+	c = a;
+	proto = c[0];
+	ns = c[4] | c[5]<<8;
+	switch(proto) {
+	default:
+		error(Ebadarg);
+	case Rawnodata:
+		ns = 0;
+		if(n != Rawhdr)
+			error(Ebadarg);
+		break;
+	case Rawpioin:
+	case Rawpioout:
+		if(ns == 0 || ns > Maxrawsect)
+			error(Ebadarg);
+		if(n != Rawhdr + (proto == Rawpioout ? ns*512 : 0))
+			error(Ebadarg);
+		break;
+	}
+
+	r = smalloc(Rawhdr + (proto == Rawpioin ? ns*512 : 0));
+	if(waserror()) {
+		free(r);
+		nexterror();
+	}
+	sataclaim();
+	if(waserror()) {
+		sataunclaim();
+		nexterror();
+	}
+
+	atawait();
+	atadone = Rtimeout;
+	ar->feat = c[3];
+	ar->sectors = c[5];
+	ar->lbalow = c[9];
+	ar->lbamid = c[10];
+	ar->lbahigh = c[11];
+	ar->feat = c[2];
+	ar->sectors = c[4];
+	ar->lbalow = c[6];
+	ar->lbamid = c[7];
+	ar->lbahigh = c[8];
+	ar->dev = c[12];
+	ar->cmd = c[1];
+
+	i = 0;
+	switch(proto) {
+	case Rawnodata:
+		atastatus(30*1000);
+		break;
+	case Rawpioin:
+		for(p = r+Rawhdr; i < ns; i++, p += 512) {
+			v = atastatus(30*1000);
+			if((v & (Aerr|Adf|Adrq)) != Adrq)
+				break;
+			pioget(p);
+		}
+		break;
+	case Rawpioout:
+		/* no interrupt for the first block, poll for drq */
+		for(;;) {
+			v = ar->status;
+			if((v & Absy) == 0)
+				break;
+			if(i++ >= 5000)
+				error(Etimeout);
+			tsleep(&up->sleep, return0, nil, 1);
+		}
+		for(i = 0, p = c+Rawhdr; i < ns && (v & (Aerr|Adf|Adrq)) == Adrq; i++, p += 512) {
+			pioput(p);
+			v = atastatus(30*1000);
+		}
+		i = 0;
+		break;
+	}
+
+	r[0] = ar->status;
+	r[1] = ar->error;
+	r[2] = ar->sectors;
+	r[4] = ar->lbalow;
+	r[5] = ar->lbamid;
+	r[6] = ar->lbahigh;
+	r[10] = ar->dev;
+	ar->ctl = 1<<7;		/* hob, read the exp registers */
+	r[3] = ar->sectors;
+	r[7] = ar->lbalow;
+	r[8] = ar->lbamid;
+	r[9] = ar->lbahigh;
+	ar->ctl = 0;
+
+	poperror();
+	sataunclaim();
+	poperror();
+	*rp = r;
+	return Rawhdr + i*512;
+}
+
+static long
+xfer(int t, uchar *buf, long n, vlong off)
+{
+	Bsreq r;
+
+	memset(&r, 0, sizeof r);
+	r.iswrite = t == Write;
+	r.buf = buf;
+	r.n = n;
+	r.off = off;
+	bssubmit(&satastore, &r);
+	return bswait(&r);
+}
+
+/* synchronous Store.io, a wrapper around satasubmit */
+static long
+sataio(void*, int iswrite, void *buf, long n, vlong off)
+{
+	return xfer(iswrite ? Write : Read, buf, n, off);
+}
+
+/* keep in sync with Disk.mode */
+static char *modes[] = {
+"ncq",
+"dma",
+"pio",
+};
+
+/* features to report, bit in cmdset word (0-2 for words 82-84), enabled in word+3 */
+typedef struct Feature Feature;
+struct Feature {
+	char	*name;
+	int	word;
+	ushort	bit;
+};
+static Feature features[] = {
+	"smart",	0,	Feat0SMART,
+	"pm",		0,	Feat0PowerMgmt,
+	"packet",	0,	Feat0Packet,
+	"wcache",	0,	Feat0Writecache,
+	"lba48",	1,	Feat1Addr48,
+	"flush",	1,	Feat1FlushCache,
+	"flushext",	1,	Feat1FlushCachExt,
+	"aam",		1,	Feat1AAM,
+	"apm",		1,	Feat1AdvPowerMgmt,
+	"smartlog",	2,	Feat2SMARTerrorlog,
+	"smarttest",	2,	Feat2SMARTselftest,
+	"gplog",	2,	Feat2Logging,
+};
+
+static long
+ctlread(void *buf, long n, vlong off)
+{
+	char *p, *s, *e;
+	Feature *f;
+
+	if(disk.valid == 0)
+		error(Enodisk);
+	s = p = smalloc(1024);
+	e = s+1024;
+	p = seprint(p, e, "inquiry %q %q\n", "", disk.model); /* manufacturer unknown */
+	p = seprint(p, e, "config serial %q firmware %q\n", disk.serial, disk.firmware);
+	p = seprint(p, e, "geometry %llud %d\n", disk.sectors, 512);
+	p = seprint(p, e, "part data %llud %llud\n", 0ULL, disk.sectors);
+	p = seprint(p, e, "mode %s tags %d multi %d\n", modes[disk.mode], ntags, disk.multi);
+	p = seprint(p, e, "features");
+	for(f = features; f < features+nelem(features); f++)
+		if(disk.dev.cmdset[f->word] & f->bit)
+			p = seprint(p, e, " %s%s", f->name, (disk.dev.cmdset[3+f->word] & f->bit) ? "" : "(off)");
+	if(disk.dev.satacap & SataCapNCQ)
+		p = seprint(p, e, " ncq");
+	if(disk.dev.dsm & DsmTrim)
+		p = seprint(p, e, " trim(%d)", disk.dev.dsmmax);
+	p = seprint(p, e, "\n");
+	p = seprint(p, e, "coalesce %d %d intrs/io %lud.%02lud\n",
+		coal.count, coal.usec,
+		stats.ndone ? stats.doneintrs/stats.ndone : 0,
+		stats.ndone ? stats.doneintrs*100/stats.ndone%100 : 0);
+	p = seprint(p, e, "stats requests %lud batches %lud qdepth avg %llud.%02llud max %d serrorintrs %lud deverrs %lud retries %lud\n",
+		stats.nreqs, stats.nbatches,
+		stats.nreqs ? stats.depthsum/stats.nreqs : 0,
+		stats.nreqs ? stats.depthsum*100/stats.nreqs%100 : 0,
+		stats.maxdepth, stats.serrorintrs, stats.deverrs, stats.retries);
+	USED(p);
+	n = readstr(off, buf, n, s);
+	free(s);
+	return n;
+}
+
+/*
+ * interrupt after count completed requests, or usec after the first
+ * completion, whichever comes first.  the time limit keeps a lone
+ * request from waiting for company.  count 0 disables coalescing.
+ */
+static void
+coalesce(int count, int usec)
+{
+	SatahcReg *hr = SATAHCREG;
+
+	if(count < 0 || count > Maxcoalcount || usec < 0 || usec > Maxcoalusec)
+		error(Ebadarg);
+	if(count > 1 && usec == 0)
+		error("coalescing needs a time limit");
+	if(count <= 1)
+		count = usec = 0;
+
+	qlock(&reqsl);
+	coal.count = count;
+	coal.usec = usec;
+	hr->intrcoalesc = count;
+	hr->intrtime = US2TMR(usec);
+	intrena(0);
+	qunlock(&reqsl);
 }
 
 static long
@@ -1139,6 +2102,23 @@ ctl(char *buf, long n)
 		flush();
 		return n;
 	}
+	if(strcmp(cb->f[0], "wcache") == 0) {
+		if(cb->nf != 2)
+			error(Ebadarg);
+		if(strcmp(cb->f[1], "on") == 0)
+			wcache(1);
+		else if(strcmp(cb->f[1], "off") == 0)
+			wcache(0);
+		else
+			error(Ebadarg);
+		return n;
+	}
+	if(strcmp(cb->f[0], "coalesce") == 0) {
+		if(cb->nf != 3)
+			error(Ebadarg);
+		coalesce(atoi(cb->f[1]), atoi(cb->f[2]));
+		return n;
+	}
 	error("bad ctl");
 	return -1;
 }
@@ -1209,38 +2189,16 @@ sataclose(Chan*)
 static long	 
 sataread(Chan *c, void *buf, long n, vlong off)
 {
-	char *p, *s, *e;
-	long r, nn;
-
 	if(c->qid.type & QTDIR)
 		return devdirread(c, buf, n, satadir, nelem(satadir), satagen);
 
 	switch((ulong)c->qid.path){
 	case Qctl:
-		if(disk.valid == 0)
-			error(Enodisk);
-		s = p = smalloc(1024);
-		e = s+1024;
-		p = seprint(p, e, "inquiry %q %q\n", "", disk.model); /* manufacturer unknown */
-		p = seprint(p, e, "config serial %q firmware %q\n", disk.serial, disk.firmware);
-		p = seprint(p, e, "geometry %llud %d\n", disk.sectors, 512);
-		p = seprint(p, e, "part data %llud %llud\n", 0ULL, disk.sectors);
-		USED(p);
-		n = readstr(off, buf, n, s);
-		free(s);
-		return n;
+		return ctlread(buf, n, off);
 	case Qdata:
 		if(!iseve())
 			error(Eperm);
-		dcwbinv(buf, n);
-		r = 0;
-		while(r < n) {
-			nn = io(Read, (uchar*)buf+r, n-r, off+r);
-			if(nn == 0)
-				break;
-			r += nn;
-		}
-		return r;
+		return xfer(Read, buf, n, off);
 	}
 	error(Egreg);
 	return 0;		/* not reached */
@@ -1249,8 +2207,6 @@ sataread(Chan *c, void *buf, long n, vlong off)
 static long	 
 satawrite(Chan *c, void *buf, long n, vlong off)
 {
-	long r, nn;
-
 	switch((ulong)c->qid.path){
 	case Qctl:
 		if(!iseve())
@@ -1259,15 +2215,7 @@ satawrite(Chan *c, void *buf, long n, vlong off)
 	case Qdata:
 		if(!iseve())
 			error(Eperm);
-		dcwbinv(buf, n);
-		r = 0;
-		while(r < n) {
-			nn = io(Write, (uchar*)buf+r, n-r, off+r);
-			if(nn == 0)
-				break;
-			r += nn;
-		}
-		return r;
+		return xfer(Write, buf, n, off);
 	}
 	error(Egreg);
 	return 0;		/* not reached */
@@ -1306,6 +2254,57 @@ satawstat(Chan *c, uchar *dp, int n)
 	return 0;
 }
 
+/* controller is set up by satainit, through #S */
+static void
+satastoreinit(Store*)
+{
+}
+
+/*
+ * reset and identify are done by satastart in the background, it calls
+ * blockstoreready when the disk can be used.  until then there is no disk.
+ */
+static void
+satadevinit(Store *d)
+{
+	if(disk.valid == 0)
+		error(Enodisk);
+	d->size = disk.sectors*512;
+	free(d->descr);
+	d->descr = smprint("model %q, serial %q, firmware %q", disk.model, disk.serial, disk.firmware);
+}
+
+static void
+sataflush(Store*)
+{
+	flush();
+}
+
+static long
+satarctl(Store*, void *a, long n, vlong off)
+{
+	return ctlread(a, n, off);
+}
+
+static long
+satawctl(Store*, void *a, long n)
+{
+	return ctl(a, n);
+}
+
+static Store satastore = {
+.alignmask	= 512-1,
+.devtype	= "sata",
+.init		= satastoreinit,
+.devinit	= satadevinit,
+.rctl		= satarctl,
+.wctl		= satawctl,
+.io		= sataio,
+.submit		= satasubmit,
+.discard	= satadiscard,
+.raw		= sataraw,
+.flush		= sataflush,
+};
 
 Dev satadevtab = {
 	'S',
@@ -16,6 +16,7 @@ void	archconsole(void);
 void	archreset(void);
 void	archreboot(void);
 void	clockinit(void);
+uvlong	clockus(void);
 void	clockcheck(void);
 void	clockpoll(void);
 void	delay(int ms);
@@ -47,6 +48,12 @@ ulong	crc32cdma(uchar *buf, ulong n);
 void	memdma(uchar *dst, uchar *src, ulong n);
 void	xordma(uchar *dst, uchar **src, int nsrc, ulong n);
 
+/* kwaes.c */
+void	kwaesbegin(int enc, uchar *key, int keybytes);
+void	kwaesrun(int enc, uchar *p, long n, uchar *ivec);
+void	kwaesend(int enc);
+ulong	kwaesloads(int enc);
+
 /* l.s */
 ulong	getcallerpc(void*);
 void	gotopc(ulong);
@@ -0,0 +1,501 @@
+/*
+ * block stores that keep a crc32c of each 4k block of another
+ * store, and check it on reads.  bs30 and up.  configured through
+ * their devctl file:
+ *	echo create bs01 format >/dev/bs30/devctl
+ * the last 1/1025 of the backing store, and one more block, hold
+ * the checksums and a header.  whatever was there is lost when the
+ * store is formatted, which clears the checksums and writes the
+ * header.  later creates without "format" check the header.  the
+ * blocks before the checksums are the data, at the same offsets.
+ * checksums are computed by the xor engine.
+ *
+ * a mismatch is posted as "corrupt" event with the offset of the
+ * block.  the read fails, or returns the data with "mode report".
+ * a checksum of zero is taken as never written, e.g. data from
+ * before the format, and is not checked.  data is written before
+ * its checksum, a crash in between causes a false mismatch.
+ */
+
+#include	"u.h"
+#include	"../port/lib.h"
+#include	"mem.h"
+#include	"dat.h"
+#include	"fns.h"
+#include	"../port/error.h"
+#include	"part.h"
+#include	"bs.h"
+
+typedef struct Integ Integ;
+typedef struct Mblk Mblk;
+
+enum {
+	Ninteg		= 2,
+	Firstnum	= 30,		/* Store.num of first integrity store */
+	Blk		= 4*1024,
+	Crcperblk	= Blk/4,
+	Nmeta		= 64,		/* checksum blocks cached, for 256mb of data */
+	Magiclen	= 8,
+
+	/* Integ.mode */
+	Mfail		= 0,
+	Mreport,
+	Moff,
+};
+
+static char *modes[] = {
+[Mfail]		"fail",
+[Mreport]	"report",
+[Moff]		"off",
+};
+
+/* cached block of checksums */
+struct Mblk
+{
+	vlong	no;		/* block of checksums, -1 if unused */
+	uchar	*buf;
+	ulong	used;		/* for lru */
+	int	written;	/* changed by current write */
+};
+
+struct Integ
+{
+	QLock;			/* for meta and configuration */
+	Store	*d;
+	Store	*bs;		/* backing store, nil when not created */
+	vlong	nblk;		/* data blocks */
+	vlong	moff;		/* offset of checksums on bs */
+	int	mode;
+
+	Mblk	meta[Nmeta];
+	uchar	*mbase;
+	ulong	clock;
+
+	ulong	nchecked;	/* blocks */
+	ulong	nunset;
+	ulong	nmismatch;
+	ulong	nmetareads;
+	ulong	nmetawrites;
+};
+
+static Integ integs[Ninteg];
+static Store stores[Ninteg];
+
+static char Enointeg[] = "integrity store not created";
+static char Ecorrupt[] = "checksum mismatch";
+static char Magic[] = "integ001";
+
+static ulong
+g32(uchar *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+static void
+p32(uchar *p, ulong v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+	p[2] = v>>16;
+	p[3] = v>>24;
+}
+
+static long
+backio(Integ *c, int iswrite, void *buf, long n, vlong off)
+{
+	Bsreq r;
+
+	memset(&r, 0, sizeof r);
+	r.iswrite = iswrite;
+	r.buf = buf;
+	r.n = n;
+	r.off = off;
+	bssubmit(c->bs, &r);
+	return bswait(&r);
+}
+
+/* cached block no of checksums.  called with c qlocked. */
+static Mblk*
+metaget(Integ *c, vlong no)
+{
+	Mblk *m, *lru;
+	int i;
+
+	lru = nil;
+	for(i = 0; i < Nmeta; i++) {
+		m = &c->meta[i];
+		if(m->no == no) {
+			m->used = ++c->clock;
+			return m;
+		}
+		if(lru == nil || m->used < lru->used)
+			lru = m;
+	}
+	m = lru;
+	m->no = -1;
+	c->nmetareads++;
+	if(backio(c, 0, m->buf, Blk, c->moff+no*Blk) != Blk)
+		error("short read of checksums");
+	m->no = no;
+	m->written = 0;
+	m->used = ++c->clock;
+	return m;
+}
+
+static void
+metapurge(Integ *c)
+{
+	int i;
+
+	for(i = 0; i < Nmeta; i++) {
+		c->meta[i].no = -1;
+		c->meta[i].used = 0;
+	}
+}
+
+static ulong*
+crcs(uchar *p, long n)
+{
+	ulong *s;
+	long i;
+
+	s = smalloc(n/Blk*sizeof s[0]);
+	for(i = 0; i < n/Blk; i++)
+		s[i] = crc32cdma(p+i*Blk, Blk);
+	return s;
+}
+
+static long
+integread(Store *d, Integ *c, uchar *p, long n, vlong off)
+{
+	ulong *s;
+	ulong v;
+	vlong b;
+	long i, bad;
+
+	n = backio(c, 0, p, n, off);
+	n -= n % Blk;
+	if(c->mode == Moff || n == 0)
+		return n;
+
+	s = crcs(p, n);
+	qlock(c);
+	if(waserror()) {
+		qunlock(c);
+		free(s);
+		nexterror();
+	}
+	bad = 0;
+	for(i = 0; i < n/Blk; i++) {
+		b = off/Blk+i;
+		v = g32(metaget(c, b/Crcperblk)->buf + b%Crcperblk*4);
+		if(v == 0) {
+			c->nunset++;
+			continue;
+		}
+		c->nchecked++;
+		if(v != s[i]) {
+			c->nmismatch++;
+			bad++;
+			bspost(d, "corrupt %s %lld\n", d->name, b*Blk);
+		}
+	}
+	poperror();
+	qunlock(c);
+	free(s);
+	if(bad && c->mode == Mfail)
+		error(Ecorrupt);
+	return n;
+}
+
+static long
+integwrite(Integ *c, uchar *p, long n, vlong off)
+{
+	ulong *s;
+	Mblk *m;
+	vlong b;
+	long i;
+
+	s = crcs(p, n);
+	if(waserror()) {
+		free(s);
+		nexterror();
+	}
+	if(backio(c, 1, p, n, off) != n)
+		error("short write");
+
+	qlock(c);
+	if(waserror()) {
+		/* checksums not written are not known to be on the store */
+		metapurge(c);
+		qunlock(c);
+		nexterror();
+	}
+	for(i = 0; i < n/Blk; i++) {
+		b = off/Blk+i;
+		m = metaget(c, b/Crcperblk);
+		p32(m->buf + b%Crcperblk*4, s[i]);
+		m->written = 1;
+	}
+	for(i = 0; i < Nmeta; i++) {
+		m = &c->meta[i];
+		if(m->written) {
+			m->written = 0;
+			c->nmetawrites++;
+			if(backio(c, 1, m->buf, Blk, c->moff+m->no*Blk) != Blk)
+				error("short write of checksums");
+		}
+	}
+	poperror();
+	qunlock(c);
+
+	poperror();
+	free(s);
+	return n;
+}
+
+static long
+integio(void *a, int iswrite, void *buf, long n, vlong off)
+{
+	Store *d;
+	Integ *c;
+
+	d = a;
+	c = d->ctlr;
+	if(c->bs == nil)
+		error(Enointeg);
+	if(off < 0 || off > d->size || off % Blk != 0 || n % Blk != 0)
+		error(Ebadarg);
+	if(n > d->size-off)
+		n = d->size-off;
+	if(n == 0)
+		return 0;
+	if(iswrite)
+		return integwrite(c, buf, n, off);
+	return integread(d, c, buf, n, off);
+}
+
+/*
+ * header in the last block of the backing store: magic and the
+ * number of data blocks.  read and written through the first
+ * checksum buffer, before the buffers are in use.
+ */
+static void
+hdrcheck(Integ *c, vlong hoff)
+{
+	uchar *p;
+
+	p = c->meta[0].buf;
+	if(backio(c, 0, p, Blk, hoff) != Blk)
+		error("short read of header");
+	if(memcmp(p, Magic, Magiclen) != 0)
+		error("checksums not initialised, use format");
+	if(g32(p+Magiclen) != (ulong)c->nblk || g32(p+Magiclen+4) != (ulong)(c->nblk>>32))
+		error("store size changed");
+}
+
+/* clear the checksums and write the header */
+static void
+format(Integ *c, vlong hoff)
+{
+	uchar *p;
+	vlong o;
+	long n;
+
+	p = c->meta[0].buf;
+	memset(p, 0, Nmeta*Blk);
+	for(o = c->moff; o < hoff; o += n) {
+		n = Nmeta*Blk;
+		if(n > hoff-o)
+			n = hoff-o;
+		if(backio(c, 1, p, n, o) != n)
+			error("short write of checksums");
+	}
+	memmove(p, Magic, Magiclen);
+	p32(p+Magiclen, c->nblk);
+	p32(p+Magiclen+4, c->nblk>>32);
+	if(backio(c, 1, p, Blk, hoff) != Blk)
+		error("short write of header");
+}
+
+/* "create store [format]" */
+static void
+integcreate(Integ *c, Cmdbuf *cb)
+{
+	Store *bs;
+	vlong nb, hoff;
+
+	if(c->bs != nil)
+		error("already created");
+	if(cb->nf == 3 && strcmp(cb->f[2], "format") != 0)
+		error(Ebadarg);
+	bs = blockstorelookup(cb->f[1]);
+	if(bs == nil)
+		error("no such store");
+	if(bs == c->d)
+		error("store cannot be on itself");
+	if(bs->ready == 0)
+		error("store not ready");
+	if(bs->alignmask >= Blk)
+		error("store alignment too large");
+
+	bsclaim(bs, c->d, 0);
+	if(waserror()) {
+		c->bs = nil;
+		bsunclaim(bs);
+		nexterror();
+	}
+
+	/* nblk data blocks and their checksum blocks must fit before the header */
+	nb = bs->size/Blk - 1;
+	if(nb <= 0)
+		error("store too small");
+	hoff = nb*Blk;
+	c->nblk = nb*Crcperblk/(Crcperblk+1);
+	if(c->nblk == 0)
+		error("store too small");
+	c->moff = c->nblk*Blk;
+
+	if(c->mbase == nil) {
+		c->mbase = malloc(Nmeta*Blk+CACHELINESIZE);
+		if(c->mbase == nil)
+			error(Enomem);
+	}
+	for(nb = 0; nb < Nmeta; nb++)
+		c->meta[nb].buf = (uchar*)(((ulong)c->mbase+CACHELINESIZE-1)&~(CACHELINESIZE-1)) + nb*Blk;
+	metapurge(c);
+
+	/* backio uses c->bs */
+	c->bs = bs;
+	if(cb->nf == 3)
+		format(c, hoff);
+	else
+		hdrcheck(c, hoff);
+	metapurge(c);
+	poperror();
+	c->d->alignmask = Blk-1;
+}
+
+static void
+integinit(Store*)
+{
+}
+
+static void
+integdevinit(Store *d)
+{
+	Integ *c;
+
+	c = d->ctlr;
+	if(c->bs == nil)
+		error(Enointeg);
+	qlock(c);
+	metapurge(c);
+	qunlock(c);
+	d->size = c->nblk*Blk;
+	free(d->descr);
+	d->descr = smprint("crc32c per %d bytes on %s", Blk, c->bs->name);
+}
+
+static long
+integrctl(Store *d, void *a, long n, vlong off)
+{
+	Integ *c;
+	char *buf, *p, *e;
+
+	c = d->ctlr;
+	buf = smalloc(READSTR);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	p = buf;
+	e = buf+READSTR;
+	if(c->bs == nil)
+		p = seprint(p, e, "not created\n");
+	else
+		p = seprint(p, e, "store %s blocks %lld checksums at %lld\n", c->bs->name, c->nblk, c->moff);
+	p = seprint(p, e, "mode %s\n", modes[c->mode]);
+	p = seprint(p, e, "checked %lud unset %lud mismatches %lud\n", c->nchecked, c->nunset, c->nmismatch);
+	p = seprint(p, e, "checksum reads %lud writes %lud\n", c->nmetareads, c->nmetawrites);
+	USED(p);
+	n = readstr(off, a, n, buf);
+	poperror();
+	free(buf);
+	return n;
+}
+
+enum {
+	CMcreate, CMmode,
+};
+static Cmdtab integctl[] = {
+	CMcreate,	"create",	0,
+	CMmode,		"mode",		2,
+};
+
+static long
+integwctl(Store *d, void *a, long n)
+{
+	Integ *c;
+	Cmdbuf *cb;
+	Cmdtab *ct;
+	int i, created;
+
+	c = d->ctlr;
+	cb = parsecmd(a, n);
+	qlock(c);
+	if(waserror()) {
+		qunlock(c);
+		free(cb);
+		nexterror();
+	}
+
+	created = 0;
+	ct = lookupcmd(cb, integctl, nelem(integctl));
+	switch(ct->index) {
+	case CMcreate:
+		if(cb->nf != 2 && cb->nf != 3)
+			error(Ebadarg);
+		integcreate(c, cb);
+		created = 1;
+		break;
+	case CMmode:
+		for(i = 0; i < nelem(modes); i++)
+			if(strcmp(cb->f[1], modes[i]) == 0)
+				break;
+		if(i == nelem(modes))
+			error(Ebadarg);
+		c->mode = i;
+		break;
+	}
+
+	poperror();
+	qunlock(c);
+	free(cb);
+
+	/* read the partitions, in a new process since d is locked by our caller */
+	if(created)
+		blockstoreready(d);
+	return n;
+}
+
+void
+integritylink(void)
+{
+	Store *d;
+	int i;
+
+	for(i = 0; i < Ninteg; i++) {
+		d = &stores[i];
+		integs[i].d = d;
+		d->ctlr = &integs[i];
+		d->num = Firstnum+i;
+		strcpy(d->devtype, "integrity");
+		d->init = integinit;
+		d->devinit = integdevinit;
+		d->rctl = integrctl;
+		d->wctl = integwctl;
+		d->io = integio;
+		blockstoreadd(d);
+	}
+}
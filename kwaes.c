@@ -0,0 +1,157 @@
+/*
+ * aes engines of the security accelerator, driven by the cpu, for
+ * kernel users like encrypted stores.  unlike cesa.c this does not
+ * replace libsec's aes, keyring and ssl keep using software.
+ *
+ * a session holds an engine, en- or decryption, for several runs with
+ * one key.  the key last loaded is remembered per engine: a session
+ * with the same key does not load it again, and for decryption does
+ * not compute the decryption key again.  cesa.c loads its own keys
+ * into the engines, it should not be configured together with this.
+ *
+ * todo:
+ * - use the security accelerator with tdma instead of pio.
+ */
+
+#include	"u.h"
+#include	"../port/lib.h"
+#include	"mem.h"
+#include	"dat.h"
+#include	"fns.h"
+#include	"../port/error.h"
+#include	"io.h"
+
+typedef struct Engine Engine;
+
+enum {
+	Bsize		= 16,
+
+	/* aes cmd */
+	AESkey128	= 0<<0,
+	AESkey192	= 1<<0,
+	AESkey256	= 2<<0,
+	AESmakekey	= 1<<2,
+	AESkeyready	= 1<<30,
+	AESdone		= 1<<31,
+};
+
+struct Engine
+{
+	QLock;			/* held during a session */
+	AesReg	*r;
+	uchar	key[32];	/* loaded */
+	int	keybytes;	/* 0 if none */
+	ulong	loads;
+};
+
+static Engine engines[2];	/* by enc */
+
+static ulong
+g32(uchar *p)
+{
+	return p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+}
+
+static void
+p32(uchar *p, ulong v)
+{
+	p[0] = v>>24;
+	p[1] = v>>16;
+	p[2] = v>>8;
+	p[3] = v;
+}
+
+/* start a session with key on the en- or decryption engine */
+void
+kwaesbegin(int enc, uchar *key, int keybytes)
+{
+	Engine *e;
+	AesReg *r;
+	ulong cmd, *k;
+	int i;
+
+	if(keybytes == 16)
+		cmd = AESkey128;
+	else if(keybytes == 24)
+		cmd = AESkey192;
+	else if(keybytes == 32)
+		cmd = AESkey256;
+	else
+		error("bad aes key length");
+
+	e = &engines[enc != 0];
+	qlock(e);
+	if(e->keybytes == keybytes && memcmp(e->key, key, keybytes) == 0)
+		return;
+
+	r = e->r = enc ? AESENCREG : AESDECREG;
+	r->cmd = cmd;
+	k = &r->key[7];
+	for(i = 0; i < keybytes; i += 4)
+		*k-- = g32(key+i);
+	if(!enc) {
+		r->cmd |= AESmakekey;
+		while((r->cmd & AESkeyready) == 0)
+			{}
+	}
+	memmove(e->key, key, keybytes);
+	e->keybytes = keybytes;
+	e->loads++;
+}
+
+void
+kwaesend(int enc)
+{
+	qunlock(&engines[enc != 0]);
+}
+
+/*
+ * en- or decrypt n bytes at p in the session on engine enc.  cbc
+ * with ivec, ecb if ivec is nil.  ivec is not updated.
+ */
+void
+kwaesrun(int enc, uchar *p, long n, uchar *ivec)
+{
+	AesReg *r;
+	uchar *e;
+	ulong v[4], c[4];
+	int i;
+
+	r = engines[enc != 0].r;
+	if(ivec != nil)
+		for(i = 0; i < 4; i++)
+			v[i] = g32(ivec+4*i);
+	else
+		v[0] = v[1] = v[2] = v[3] = 0;
+	for(e = p+n; p < e; p += Bsize) {
+		for(i = 0; i < 4; i++)
+			c[i] = g32(p+4*i);
+		if(enc) {
+			for(i = 0; i < 4; i++)
+				r->data[3-i] = c[i]^v[i];
+		} else {
+			for(i = 0; i < 4; i++)
+				r->data[3-i] = c[i];
+		}
+		while((r->cmd & AESdone) == 0)
+			{}
+		for(i = 0; i < 4; i++) {
+			if(enc) {
+				v[i] = r->data[3-i];
+				p32(p+4*i, v[i]);
+			} else {
+				p32(p+4*i, r->data[3-i]^v[i]);
+				v[i] = c[i];
+			}
+		}
+		if(ivec == nil)
+			v[0] = v[1] = v[2] = v[3] = 0;
+	}
+}
+
+/* key loads of the engines, for statistics */
+ulong
+kwaesloads(int enc)
+{
+	return engines[enc != 0].loads;
+}
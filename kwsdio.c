@@ -3,10 +3,9 @@
  *
  * todo:
  * - don't crash when proc doing read/write is killed.
- * - look at effects of csd.eraseblk and csd.erasesecsize on erase() and possibly pre-write-erase.
+ * - look at effects of csd.eraseblk and csd.erasesecsize on pre-write-erase.
  * - wait reading dat[0] in hoststate for r1b responses?
  * - read scr register and use it to determine if card supports 4bit data bus
- * - see if we can detect device inserts/ejects?  yes, by sd_cd gpio pin (on mpp47).
  */
 
 #include	"u.h"
@@ -31,8 +30,16 @@ static struct {
 	Card	card;
 	Rendez	cmdr;
 	int	preerase;
+
+	/* card detect */
+	Rendez	cdr;
+	int	cdchange;
+	int	present;
+	int	cdstarted;
 } sdio;
 
+static Store sdiodisk;
+
 enum {
 	/* keep in sync with errstrs[] */
 	SDOk		= 0,
@@ -107,6 +114,10 @@ enum {
 	/* swreset */
 	SRresetall	= 1<<8,
 
+	/* card detect, sd_cd on mpp47, gpio high 15.  low when a card is present. */
+	Gpiocd		= 1<<(47-32),
+	Cddebounce	= 100,		/* ms */
+
 	/* st, status */
 	Scmdcomplete	= 1<<0,
 	Sxfercomplete	= 1<<1,
@@ -657,7 +668,7 @@ erase(Card *c, vlong offset, long n)
 }
 
 static long
-sdioio(void *dd, int iswrite, void *buf, long n, vlong off)
+sdioio0(void *dd, int iswrite, void *buf, long n, vlong off)
 {
 	char *a = buf;
 	ulong cmd, arg, fl, h, nn;
@@ -674,10 +685,6 @@ sdioio(void *dd, int iswrite, void *buf, long n, vlong off)
 	if(sdio.card.valid == 0)
 		error(Enocard);
 
-	/* xxx we should cover this case with a buffer, and then use the same code to allow non-sector-aligned reads? */
-	if((ulong)a % 4 != 0)
-		error("bad buffer alignment...");
-
 	if(off & (512-1))
 		error("not sector aligned");
 	if(n & (512-1))
@@ -721,6 +728,66 @@ sdioio(void *dd, int iswrite, void *buf, long n, vlong off)
 	return n;
 }
 
+/* smallest area erase() can erase, ranges to discard are shrunk to multiples */
+static long
+eraseunit(Card *c)
+{
+	if(c->sdhc || c->csd.eraseblk)
+		return 512;
+	return (1<<c->csd.wbl)*(c->csd.erasesecsz+1);
+}
+
+enum {
+	Maxerase	= 64*1024*1024,	/* bytes per erase command, to bound the time the card is busy */
+};
+
+static void
+sdiodiscard(Store*, Bsrange *r, int nr)
+{
+	vlong o, e;
+	long u, nn;
+	int i, s;
+
+	qlock(&sdio);
+	if(waserror()) {
+		qunlock(&sdio);
+		nexterror();
+	}
+
+	if(sdio.card.valid == 0)
+		error(Enocard);
+
+	u = eraseunit(&sdio.card);
+	for(i = 0; i < nr; i++) {
+		o = (r[i].off+u-1)/u*u;
+		e = (r[i].off+r[i].n)/u*u;
+		for(; o < e; o += nn) {
+			nn = Maxerase/u*u;
+			if(nn > e-o)
+				nn = e-o;
+			s = erase(&sdio.card, o, nn);
+			if(s < 0)
+				errorsd("erase", s);
+
+			/* give others a chance */
+			qunlock(&sdio);
+			qlock(&sdio);
+		}
+	}
+
+	poperror();
+	qunlock(&sdio);
+}
+
+/* dma needs 4-byte aligned buffers, copy others */
+static long
+sdioio(void *dd, int iswrite, void *buf, long n, vlong off)
+{
+	if((ulong)buf % 4 != 0)
+		return bsbounceio(sdioio0, dd, iswrite, buf, n, off);
+	return sdioio0(dd, iswrite, buf, n, off);
+}
+
 static void
 sdiointr(Ureg*, void*)
 {
@@ -776,9 +843,79 @@ sdioinit0(void)
 	intrenable(Irqlo, IRQ0sdio, sdiointr, nil, "sdio");
 }
 
+static int
+cardpresent(void)
+{
+	GpioReg *g = GPIO1REG;
+
+	return ((g->datain ^ g->datainpol) & Gpiocd) == 0;
+}
+
+/*
+ * interrupt when sd_cd differs from the state seen last.  the pin
+ * polarity is set so the current level reads as 0, a level interrupt
+ * then signals the change.
+ */
+static void
+cdarm(void)
+{
+	GpioReg *g = GPIO1REG;
+
+	if(sdio.present)
+		g->datainpol &= ~Gpiocd;
+	else
+		g->datainpol |= Gpiocd;
+	g->intrlevelena |= Gpiocd;
+}
+
+static void
+sdiocdintr(Ureg*, void*)
+{
+	GpioReg *g = GPIO1REG;
+
+	g->intrlevelena &= ~Gpiocd;
+	sdio.cdchange = 1;
+	wakeup(&sdio.cdr);
+	intrclear(Irqhi, IRQ1gpiohi1);
+}
+
+static int
+cdchanged(void*)
+{
+	return sdio.cdchange;
+}
+
+/* tell devbs about inserted and ejected cards */
+static void
+sdiocdproc(void*)
+{
+	int present;
+
+	for(;;) {
+		sleep(&sdio.cdr, cdchanged, nil);
+		tsleep(&up->sleep, return0, nil, Cddebounce);
+		sdio.cdchange = 0;
+
+		present = cardpresent();
+		if(present != sdio.present) {
+			sdio.present = present;
+			if(present) {
+				blockstorearrive(&sdiodisk);
+				blockstoreready(&sdiodisk);
+			} else {
+				sdio.card.valid = 0;
+				blockstoregone(&sdiodisk);
+			}
+		}
+		cdarm();
+	}
+}
+
 static void
 sdioinit(Store *)
 {
+	GpioReg *g = GPIO1REG;
+
 	qlock(&sdio);
 	if(waserror()) {
 		qunlock(&sdio);
@@ -787,6 +924,17 @@ sdioinit(Store *)
 
 	sdioinit0();
 
+	if(!sdio.cdstarted) {
+		sdio.cdstarted = 1;
+		MPPREG->ctl[5] &= ~(MASK(4)<<28);	/* mpp47 is gpio */
+		g->datainpol &= ~Gpiocd;
+		g->dataoutena |= Gpiocd;	/* 1 is input */
+		sdio.present = cardpresent();
+		intrenable(Irqhi, IRQ1gpiohi1, sdiocdintr, nil, "sdcd");
+		kproc("sdiocd", sdiocdproc, nil, 0);
+		cdarm();
+	}
+
 	poperror();
 	qunlock(&sdio);
 }
@@ -903,6 +1051,7 @@ static Store sdiodisk = {
 .rctl		= sdiorctl,
 .wctl		= sdiowctl,
 .io		= sdioio,
+.discard	= sdiodiscard,
 };
 
 void
@@ -419,9 +419,12 @@ userinit(void)
 void
 exit(int inpanic)
 {
-	up = 0;
+	/* devices may need a process to shut down, e.g. to write back buffered data */
+	if(inpanic)
+		up = 0;
 
 	chandevshutdown();
+	up = 0;
 
 	if(inpanic && !panicreset){
 		print("Hit the reset button\n");
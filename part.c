@@ -8,12 +8,27 @@
 
 static char Elongname[] = "partition name too long";
 
+typedef long (*Readf)(void*, int, void*, long, vlong);
+
+enum {
+	Sectsz		= 512,
+	Gptmaxent	= 1024,		/* entries in table */
+	Maxlogical	= 128,		/* in extended partition */
+	Ebrwin		= 64*1024,	/* read at once when following the ebr chain */
+};
+
 static ulong
 g32(uchar *p)
 {
 	return (ulong)p[3]<<24 | (ulong)p[2]<<16 | (ulong)p[1]<<8 | (ulong)p[0]<<0;
 }
 
+static uvlong
+g64(uchar *p)
+{
+	return (uvlong)g32(p+4)<<32 | g32(p);
+}
+
 static int
 haspartname(Part *p, int np, char *s)
 {
@@ -61,6 +76,15 @@ partname(Part *p, Part *parts, int nparts, int i)
 	case 0x0e:	/* dos fat-16 */
 		partgenname(p, parts, nparts, "9fat", "dos");
 		break;
+	case 0x82:	/* linux swap */
+		partgenname(p, parts, nparts, "swap", "swap");
+		break;
+	case 0x83:	/* linux */
+		partgenname(p, parts, nparts, "linux", "linux");
+		break;
+	case 0xef:	/* efi system */
+		partgenname(p, parts, nparts, "esp", "esp");
+		break;
 	default:
 		snprint(p->name, sizeof p->name, "p%d", i);
 	}
@@ -110,31 +134,304 @@ printpartadd(Part *p)
 		(int)p->index, (uint)p->typ, p->name, p->s, p->e, p->size);
 }
 
-int
-partinit(long (*r)(void *, int, void *, long, vlong), void *disk, vlong size, Part **partsp)
+static ulong crctabs[256];
+static ulong *crctab;		/* crctabs once filled */
+
+/*
+ * crc-32 as used by gpt, reflected 0x04c11db7.  partinit runs in a
+ * kproc per store, the table is used only when complete.  filling
+ * it again at the same time writes the same values.
+ */
+static ulong
+crc32(uchar *p, long n)
 {
-	uchar buf[512+63+1];
-	uchar *p = (void*)(((ulong)buf+63)&~63);
+	ulong c, *t;
+	int i, j;
+
+	t = crctab;
+	if(t == nil) {
+		t = crctabs;
+		for(i = 0; i < 256; i++) {
+			c = i;
+			for(j = 0; j < 8; j++)
+				c = (c&1) ? 0xedb88320^(c>>1) : c>>1;
+			t[i] = c;
+		}
+		crctab = t;
+	}
+	c = ~0;
+	while(n-- > 0)
+		c = t[(c^*p++)&0xff] ^ (c>>8);
+	return ~c;
+}
+
+typedef struct Gpt Gpt;
+struct Gpt
+{
+	uvlong	first;		/* usable lba's */
+	uvlong	last;
+	uvlong	entlba;
+	ulong	nent;
+	ulong	entsz;
+	ulong	entcrc;
+};
+
+/* well-known partition type guids, mapped to mbr types for partname */
+static struct {
+	char	*guid;
+	uchar	typ;
+} gpttypes[] = {
+	"C91818F9-8025-47AF-89D2-F030D7000C2C",	0x39,	/* plan 9 */
+	"EBD0A0A2-B9E5-4433-87C0-68B6B72699C7",	0x0b,	/* microsoft basic data */
+	"C12A7328-F81F-11D2-BA4B-00A0C93EC93B",	0xef,	/* efi system */
+	"0FC63DAF-8483-4772-8E79-3D69D8477DE4",	0x83,	/* linux filesystem */
+	"0657FD6D-A4AB-43C4-84E5-0933C84B4F4F",	0x82,	/* linux swap */
+};
+
+/* first three fields are little endian */
+static void
+guidfmt(char *s, int n, uchar *g)
+{
+	snprint(s, n, "%08luX-%04uX-%04uX-%02uX%02uX-%02uX%02uX%02uX%02uX%02uX%02uX",
+		g32(g), (uint)(g[5]<<8|g[4]), (uint)(g[7]<<8|g[6]),
+		(uint)g[8], (uint)g[9], (uint)g[10], (uint)g[11], (uint)g[12], (uint)g[13], (uint)g[14], (uint)g[15]);
+}
+
+/* buffer of n bytes aligned for dma, *base is to be freed */
+static uchar*
+alignalloc(long n, uchar **base)
+{
+	*base = malloc(n+63);
+	if(*base == nil)
+		error(Enomem);
+	return (uchar*)(((ulong)*base+63)&~63);
+}
+
+/* read and check gpt header at lba into g.  p is a sector buffer. */
+static int
+gptheader(Readf r, void *disk, uchar *p, uvlong lba, vlong size, Gpt *g)
+{
+	ulong crc, hsz;
+	uvlong nsect;
+
+	if(r(disk, 0, p, Sectsz, lba*Sectsz) != Sectsz)
+		return -1;
+	if(memcmp(p, "EFI PART", 8) != 0)
+		return -1;
+	hsz = g32(p+12);
+	if(hsz < 92 || hsz > Sectsz)
+		return -1;
+	crc = g32(p+16);
+	memset(p+16, 0, 4);
+	if(crc32(p, hsz) != crc || g64(p+24) != lba)
+		return -1;
+
+	nsect = size/Sectsz;
+	g->first = g64(p+40);
+	g->last = g64(p+48);
+	g->entlba = g64(p+72);
+	g->nent = g32(p+80);
+	g->entsz = g32(p+84);
+	g->entcrc = g32(p+88);
+	if(g->entsz < 128 || g->entsz % 128 != 0 || g->entsz > Sectsz || g->nent == 0 || g->nent > Gptmaxent)
+		return -1;
+	if(g->first > g->last || g->last >= nsect || g->entlba >= nsect)
+		return -1;
+	return 0;
+}
+
+/*
+ * partitions from the guid partition table.  the primary header is
+ * at lba 1, the backup in the last sector, used when the primary or
+ * its table is damaged.
+ */
+static int
+gptparts(Readf r, void *disk, vlong size, Part **partsp, uchar *p)
+{
+	Gpt g;
+	uchar *base, *t, *ent;
+	char guid[40], name[36+1];
 	long n;
-	int i, end, o;
-	Part *pp;
-	int nparts = 1;
-	Part *parts = *partsp;
-	char *s, *e;
-	char *f[4];
-	int nf;
+	int i, j, c, nparts, which, bad;
+	Part *pp, *parts;
 
-	n = r(disk, 0, p, 512, 0);
-	if(n != 512)
-		error("reading mbr");
+	base = nil;
+	if(waserror()) {
+		free(base);
+		nexterror();
+	}
+	t = nil;
+	for(which = 0; which < 2; which++) {
+		if(gptheader(r, disk, p, which == 0 ? 1 : size/Sectsz-1, size, &g) < 0)
+			continue;
+		n = (g.nent*g.entsz+Sectsz-1) & ~(Sectsz-1);
+		free(base);
+		t = alignalloc(n, &base);
+		if(r(disk, 0, t, n, g.entlba*Sectsz) == n && crc32(t, g.nent*g.entsz) == g.entcrc)
+			break;
+	}
+	if(which == 2)
+		error("no valid gpt");
+	if(which == 1)
+		print("gpt: primary header or table bad, using backup\n");
 
-	if(p[510] != 0x55 || p[511] != 0xaa)
-		error("missing mbr signature");
+	nparts = 1;
+	parts = *partsp;
+	for(i = 0; i < g.nent; i++) {
+		ent = t+i*g.entsz;
+		for(j = 0; j < 16 && ent[j] == 0; j++)
+			{}
+		if(j == 16)
+			continue;	/* unused */
+		if(nparts > 255)
+			error("too many partitions");
+
+		*partsp = parts = partrealloc(parts, nparts);
+		pp = &parts[nparts];
+		partclear(pp);
+		pp->index = nparts;
+		pp->typ = 0xee;
+		guidfmt(guid, sizeof guid, ent);
+		for(j = 0; j < nelem(gpttypes); j++)
+			if(cistrcmp(gpttypes[j].guid, guid) == 0)
+				pp->typ = gpttypes[j].typ;
+
+		/* utf-16 name, used for unknown types if plain ascii */
+		bad = 0;
+		for(j = 0; j < 36; j++) {
+			c = ent[56+2*j] | ent[56+2*j+1]<<8;
+			if(c == 0)
+				break;
+			if(!(c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c >= '0' && c <= '9' || c == '-' || c == '_' || c == '.')) {
+				bad = 1;
+				break;
+			}
+			name[j] = c;
+		}
+		name[bad ? 0 : j] = 0;
+		if(pp->typ == 0xee && name[0] != 0)
+			partgenname(pp, parts, nparts, name, name);
+		else
+			partname(pp, parts, nparts, i);
 
-	/* partitions from mbr partition table */
+		if(g64(ent+32) < g.first || g64(ent+40) > g.last || g64(ent+32) > g64(ent+40))
+			error("bad gpt partition");
+		pp->s = (vlong)g64(ent+32)*Sectsz;
+		pp->e = (vlong)(g64(ent+40)+1)*Sectsz;
+		pp->size = pp->e-pp->s;
+		partcheck(pp, parts, nparts, size);
+		nparts++;
+		printpartadd(pp);
+	}
+	poperror();
+	free(base);
+	return nparts;
+}
+
+static int
+isextended(int typ)
+{
+	return typ == 0x05 || typ == 0x0f || typ == 0x85;
+}
+
+/*
+ * logical partitions in the extended partition s,e, from its chain of
+ * extended boot records.  the first entry of a record is a logical
+ * partition relative to the record, the second links to the next
+ * record, relative to s.  links must go forward, so the chain cannot
+ * loop.  Ebrwin bytes are read at a time, records close together
+ * (e.g. for small partitions) need no further reads.  logical
+ * partitions are numbered from 4, after the primary ones.
+ */
+static int
+ebrparts(Readf r, void *disk, Part **partsp, int nparts, vlong s, vlong e)
+{
+	uchar *base, *w, *p;
+	vlong ws, off, next;
+	long n;
+	int i;
+	Part *pp, *parts;
+
+	base = nil;
+	if(waserror()) {
+		free(base);
+		nexterror();
+	}
+	w = alignalloc(Ebrwin, &base);
+	ws = -1;
+	n = 0;
+	parts = *partsp;
+	off = s;
+	for(i = 0; i < Maxlogical; i++) {
+		if(ws < 0 || off < ws || off+Sectsz > ws+n) {
+			ws = off;
+			n = Ebrwin;
+			if(ws+n > e)
+				n = e-ws;
+			if(r(disk, 0, w, n, ws) != n)
+				error("reading extended boot record");
+		}
+		p = w+(off-ws);
+		if(p[510] != 0x55 || p[511] != 0xaa)
+			error("missing extended boot record signature");
+
+		if(p[446+0x4] != 0 && !isextended(p[446+0x4])) {
+			if(nparts > 255)
+				error("too many partitions");
+			*partsp = parts = partrealloc(parts, nparts);
+			pp = &parts[nparts];
+			partclear(pp);
+			pp->index = nparts;
+			pp->typ = p[446+0x4];
+			partname(pp, parts, nparts, 4+i);
+			pp->s = off+(vlong)g32(p+446+0x8)*Sectsz;
+			pp->size = (vlong)g32(p+446+0xc)*Sectsz;
+			pp->e = pp->s+pp->size;
+			if(pp->s <= off || pp->e > e)
+				error("logical partition outside extended partition");
+			partcheck(pp, parts, nparts, e);
+			nparts++;
+			printpartadd(pp);
+		}
+
+		if(!isextended(p[446+16+0x4]))
+			break;
+		next = s+(vlong)g32(p+446+16+0x8)*Sectsz;
+		if(next <= off || next+Sectsz > e)
+			error("bad extended partition link");
+		off = next;
+	}
+	if(i == Maxlogical)
+		error("too many logical partitions");
+	poperror();
+	free(base);
+	return nparts;
+}
+
+/* partitions from mbr partition table in p, and logical ones in the first extended partition */
+static int
+mbrparts(Readf r, void *disk, uchar *p, vlong size, Part **partsp)
+{
+	int i, o, nparts;
+	Part *pp, *parts;
+	vlong xs, xe;
+
+	nparts = 1;
+	parts = *partsp;
+	xs = xe = 0;
 	for(i = 0; i < 4; i++) {
 		o = 446+i*16;
 
+		if(isextended(p[o+0x4])) {
+			if(xe == 0) {
+				xs = (vlong)g32(p+o+0x8)*512;
+				xe = xs+(vlong)g32(p+o+0xc)*512;
+				if(xe > size || xs >= xe)
+					error("bad extended partition");
+			}
+			continue;
+		}
+
 		*partsp = parts = partrealloc(parts, nparts);
 		pp = &parts[nparts];
 		partclear(pp);
@@ -151,6 +448,41 @@ partinit(long (*r)(void *, int, void *, long, vlong), void *disk, vlong size, Pa
 		nparts++;
 		printpartadd(pp);
 	}
+	if(xe != 0)
+		nparts = ebrparts(r, disk, partsp, nparts, xs, xe);
+	return nparts;
+}
+
+int
+partinit(Readf r, void *disk, vlong size, Part **partsp)
+{
+	uchar buf[512+63+1];
+	uchar *p = (void*)(((ulong)buf+63)&~63);
+	long n;
+	int i, end;
+	Part *pp;
+	int nparts;
+	Part *parts;
+	char *s, *e;
+	char *f[4];
+	int nf;
+
+	n = r(disk, 0, p, 512, 0);
+	if(n != 512)
+		error("reading mbr");
+
+	if(p[510] != 0x55 || p[511] != 0xaa)
+		error("missing mbr signature");
+
+	/* protective mbr, partitions are in the gpt */
+	for(i = 0; i < 4; i++)
+		if(p[446+i*16+0x4] == 0xee)
+			break;
+	if(i < 4)
+		nparts = gptparts(r, disk, size, partsp, p);
+	else
+		nparts = mbrparts(r, disk, p, size, partsp);
+	parts = *partsp;
 
 	/* set up partitions in the plan 9 parts */
 	end = nparts;
@@ -184,7 +516,7 @@ partinit(long (*r)(void *, int, void *, long, vlong), void *disk, vlong size, Pa
 			pp->size = pp->e-pp->s;
 			partcheck(pp, parts+i, nparts-i, parts[i].size);
 			pp->s += parts[i].s;
-			pp->e += parts[i].e;
+			pp->e += parts[i].s;
 			nparts++;
 			printpartadd(pp);
 		}
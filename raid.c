@@ -0,0 +1,965 @@
+/*
+ * raid-1 and raid-5 arrays of other block stores.  arrays are
+ * stores themselves, bs10 and up, with partitions like any other.
+ * they are configured through their devctl file, e.g.
+ *	echo create raid5 bs01 bs02 bs03 sync >/dev/bs10/devctl
+ * "sync" is for the first create: the mirrors are copied from the
+ * first member, or raid-5 parity is made consistent by rebuilding the
+ * last member, in the background.  what was on the members is lost.
+ * nothing is kept on the members, an array has to be created again
+ * after boot, with the same members in the same order and without
+ * "sync".  members are assumed to be in sync then.  members are
+ * claimed by the array, their data and partitions cannot be opened
+ * while in it.
+ *
+ * raid-5 parity is left-asymmetric and computed by the xor engine.
+ * while a member has failed, the regions written are recorded in
+ * a bitmap.  when the member is added back, only those regions are
+ * resynced.  a new member is resynced completely.
+ *
+ * todo:
+ * - keep a superblock and the bitmap on the members, for assembly and for resync after a crash.
+ */
+
+#include	"u.h"
+#include	"../port/lib.h"
+#include	"mem.h"
+#include	"dat.h"
+#include	"fns.h"
+#include	"../port/error.h"
+#include	"part.h"
+#include	"bs.h"
+
+typedef struct Member Member;
+typedef struct Mreq Mreq;
+typedef struct Raid Raid;
+
+enum {
+	Narray		= 2,
+	Firstnum	= 10,		/* Store.num of first array */
+	Maxmembers	= 8,		/* xor engine takes 8 sources */
+	Chunk		= 64*1024,	/* raid-5 stripe unit, raid-1 read unit */
+	Bmregion	= 4*1024*1024,	/* bytes of member per bitmap bit */
+
+	/* Member.state */
+	Mok		= 0,
+	Mfailed,
+	Msync,			/* being resynced, written but not read */
+};
+
+static char *mstates[] = {
+[Mok]		"ok",
+[Mfailed]	"failed",
+[Msync]		"resync",
+};
+
+struct Member
+{
+	Store	*s;
+	int	state;
+	char	name[KNAMELEN];	/* of store, kept when failed, to recognize it when added again */
+	ulong	nerrs;
+};
+
+/* request to a member */
+struct Mreq
+{
+	Bsreq;
+	int	i;		/* member */
+	uchar	*dst;		/* for raid-5 reads, where to reconstruct to on failure */
+	vlong	s;		/* stripe */
+	long	co;		/* offset in chunk */
+};
+
+struct Raid
+{
+	QLock	wl;		/* for writes, degraded reads, resync and changing members */
+	Store	*d;
+	int	level;		/* 1 or 5, 0 when not configured */
+	int	n;		/* members */
+	Member	m[Maxmembers];
+	vlong	msize;		/* used of each member, multiple of Chunk */
+	int	rr;		/* raid-1 member to read from next */
+
+	uchar	*sbuf;		/* n+1 chunks, one per member and one for xor, aligned */
+	uchar	*sbase;
+
+	uchar	*bitmap;	/* regions written while a member had failed */
+	long	nbits;
+	int	syncing;	/* resync kproc running */
+	int	restart;	/* member added during resync */
+	vlong	syncpos;
+
+	ulong	ndegraded;	/* reads reconstructed from other members */
+	ulong	nrmw;		/* raid-5 read-modify-write stripe updates */
+	ulong	nrcw;		/* raid-5 reconstruct-write stripe updates */
+};
+
+static Raid raids[Narray];
+static Store arrays[Narray];
+
+static char Etoomany[] = "too many failed members";
+static char Enoarray[] = "array not created";
+
+static uchar*
+slot(Raid *r, int i)
+{
+	return r->sbuf+i*Chunk;
+}
+
+/* raid-5 parity member of stripe s */
+static int
+pdisk(Raid *r, vlong s)
+{
+	return r->n-1 - s%r->n;
+}
+
+/* raid-5 member holding data chunk dd of stripe s */
+static int
+ddisk(Raid *r, vlong s, int dd)
+{
+	return dd < pdisk(r, s) ? dd : dd+1;
+}
+
+static int
+nstate(Raid *r, int st)
+{
+	int i, n;
+
+	n = 0;
+	for(i = 0; i < r->n; i++)
+		if(r->m[i].state == st)
+			n++;
+	return n;
+}
+
+static void
+mfail(Raid *r, int i, char *err)
+{
+	Member *m;
+
+	m = &r->m[i];
+	m->nerrs++;
+	if(m->state == Mfailed)
+		return;
+	m->state = Mfailed;
+	print("%s: member %d (%s) failed: %s\n", r->d->name, i, m->name, err);
+}
+
+/* whether reads and writes can still be done */
+static void
+redundant(Raid *r)
+{
+	if(r->level == 1 && nstate(r, Mok) == 0
+	|| r->level == 5 && nstate(r, Mok) < r->n-1)
+		error(Etoomany);
+}
+
+static void
+bitset(Raid *r, vlong off, long n)
+{
+	long b;
+
+	if(nstate(r, Mfailed) == 0)
+		return;
+	for(b = off/Bmregion; b <= (off+n-1)/Bmregion && b < r->nbits; b++)
+		r->bitmap[b/8] |= 1<<(b%8);
+}
+
+static void
+mstart(Raid *r, Mreq *q, int i, int iswrite, void *buf, long n, vlong off)
+{
+	memset(q, 0, sizeof q[0]);
+	q->i = i;
+	q->iswrite = iswrite;
+	q->buf = buf;
+	q->n = n;
+	q->off = off;
+	if(waserror()) {
+		kstrcpy(q->err, up->env->errstr, sizeof q->err);
+		q->done = 1;
+		return;
+	}
+	bssubmit(r->m[i].s, q);
+	poperror();
+}
+
+/* wait for requests, failed members are marked.  returns number of failed requests. */
+static int
+mwait(Raid *r, Mreq *q, int nq)
+{
+	int i, nfail;
+
+	nfail = 0;
+	for(i = 0; i < nq; i++) {
+		if(waserror()) {
+			if(q[i].err[0] == 0)
+				kstrcpy(q[i].err, up->env->errstr, sizeof q[i].err);
+			mfail(r, q[i].i, q[i].err);
+			nfail++;
+			continue;
+		}
+		if(bswait(&q[i]) != q[i].n)
+			error("short i/o");
+		poperror();
+	}
+	return nfail;
+}
+
+static Mreq*
+mreqs(int n)
+{
+	return smalloc(n*sizeof (Mreq));
+}
+
+/* read chunk-sized pieces from ok members in turn, retrying failed pieces on others */
+static long
+r1read(Raid *r, uchar *buf, long n, vlong off)
+{
+	Mreq *q;
+	long h, l;
+	int i, j, k, nq, nfail;
+
+	q = mreqs(n/Chunk+2);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	nq = 0;
+	for(h = 0; h < n; h += l) {
+		l = Chunk - (off+h)%Chunk;
+		if(l > n-h)
+			l = n-h;
+		redundant(r);
+		for(j = 0; j < r->n; j++) {
+			i = (r->rr+j) % r->n;
+			if(r->m[i].state == Mok)
+				break;
+		}
+		r->rr = i+1;
+		mstart(r, &q[nq++], i, 0, buf+h, l, off+h);
+	}
+	nfail = mwait(r, q, nq);
+	while(nfail > 0) {
+		nfail = 0;
+		for(k = 0; k < nq; k++) {
+			if(q[k].err[0] == 0)
+				continue;
+			redundant(r);
+			for(i = 0; r->m[i].state != Mok; i++)
+				{}
+			r->ndegraded++;
+			mstart(r, &q[k], i, 0, q[k].buf, q[k].n, q[k].off);
+			nfail += mwait(r, &q[k], 1);
+		}
+	}
+	poperror();
+	free(q);
+	return n;
+}
+
+/* write to all members that are not failed.  called with wl held. */
+static long
+r1write(Raid *r, uchar *buf, long n, vlong off)
+{
+	Mreq *q;
+	int i, nq;
+
+	redundant(r);
+	q = mreqs(r->n);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	nq = 0;
+	for(i = 0; i < r->n; i++)
+		if(r->m[i].state != Mfailed)
+			mstart(r, &q[nq++], i, 1, buf, n, off);
+	if(mwait(r, q, nq) == nq)
+		error(Etoomany);
+	bitset(r, off, n);
+	poperror();
+	free(q);
+	return n;
+}
+
+/* read columns co..co+n of all members but miss in stripe s, xor them into dst.  called with wl held. */
+static void
+r5rebuild(Raid *r, vlong s, int miss, long co, long n, uchar *dst)
+{
+	Mreq *q;
+	uchar *src[Maxmembers];
+	int i, nq;
+
+	q = mreqs(r->n);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	nq = 0;
+	for(i = 0; i < r->n; i++) {
+		if(i == miss)
+			continue;
+		if(r->m[i].state != Mok)
+			error(Etoomany);
+		src[nq] = slot(r, i);
+		mstart(r, &q[nq], i, 0, src[nq], n, s*Chunk+co);
+		nq++;
+	}
+	if(mwait(r, q, nq) > 0)
+		error(Etoomany);
+	xordma(dst, src, nq, n);
+	poperror();
+	free(q);
+}
+
+static long
+r5read(Raid *r, uchar *buf, long n, vlong off)
+{
+	Mreq *q;
+	vlong sw, s, so;
+	long h, l, co;
+	int i, k, nq;
+
+	sw = (vlong)Chunk*(r->n-1);
+	q = mreqs(n/Chunk+2);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	nq = 0;
+	for(h = 0; h < n; h += l) {
+		s = (off+h)/sw;
+		so = (off+h)%sw;
+		co = so%Chunk;
+		l = Chunk-co;
+		if(l > n-h)
+			l = n-h;
+		i = ddisk(r, s, so/Chunk);
+		if(r->m[i].state == Mok)
+			mstart(r, &q[nq], i, 0, buf+h, l, s*Chunk+co);
+		else {
+			memset(&q[nq], 0, sizeof q[nq]);
+			q[nq].i = i;
+			q[nq].n = l;
+			strcpy(q[nq].err, "member not ok");
+			q[nq].done = 1;
+		}
+		q[nq].dst = buf+h;
+		q[nq].s = s;
+		q[nq].co = co;
+		nq++;
+	}
+	for(k = 0; k < nq; k++) {
+		if(q[k].buf == nil)
+			continue;
+		if(waserror()) {
+			mfail(r, q[k].i, up->env->errstr);
+			continue;
+		}
+		if(bswait(&q[k]) != q[k].n)
+			error("short i/o");
+		poperror();
+	}
+
+	for(k = 0; k < nq; k++) {
+		if(q[k].err[0] == 0)
+			continue;
+		qlock(&r->wl);
+		if(waserror()) {
+			qunlock(&r->wl);
+			nexterror();
+		}
+		r5rebuild(r, q[k].s, q[k].i, q[k].co, q[k].n, slot(r, r->n));
+		memmove(q[k].dst, slot(r, r->n), q[k].n);
+		r->ndegraded++;
+		poperror();
+		qunlock(&r->wl);
+	}
+	poperror();
+	free(q);
+	return n;
+}
+
+/*
+ * write so..so+n of stripe s.  only the columns cs..ce touched in
+ * the chunks are read and written.  with all members ok and few
+ * chunks touched, the old data and parity are read and the parity
+ * updated (read-modify-write).  otherwise the untouched chunks are
+ * read and the parity computed from all data (reconstruct-write),
+ * a chunk on a member that is not ok is reconstructed first when
+ * it is needed.  called with wl held.
+ */
+static void
+r5stripe(Raid *r, vlong s, long so, uchar *buf, long n)
+{
+	Mreq *q;
+	uchar *src[Maxmembers];
+	long cs, ce, w, pcs, pce;
+	vlong mo;
+	int dd, dd0, dd1, ndata, nt, nfull, i, pd, miss, nq, ns, rmw;
+
+	ndata = r->n-1;
+	dd0 = so/Chunk;
+	dd1 = (so+n-1)/Chunk;
+	if(dd0 == dd1) {
+		cs = so%Chunk;
+		ce = cs+n;
+	} else {
+		cs = 0;
+		ce = Chunk;
+	}
+	w = ce-cs;
+	mo = s*Chunk+cs;
+	pd = pdisk(r, s);
+	nt = dd1-dd0+1;
+	nfull = 0;
+	for(dd = dd0; dd <= dd1; dd++)
+		if(dd*Chunk+cs >= so && dd*Chunk+ce <= so+n)
+			nfull++;
+
+	q = mreqs(r->n);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	for(;;) {
+		redundant(r);
+		rmw = nstate(r, Mok) == r->n && nt+1 < ndata-nfull;
+		miss = -1;
+		nq = 0;
+		if(rmw) {
+			for(dd = dd0; dd <= dd1; dd++) {
+				i = ddisk(r, s, dd);
+				mstart(r, &q[nq++], i, 0, slot(r, i), w, mo);
+			}
+			mstart(r, &q[nq++], pd, 0, slot(r, pd), w, mo);
+		} else {
+			for(dd = 0; dd < ndata; dd++) {
+				i = ddisk(r, s, dd);
+				if(r->m[i].state != Mok) {
+					if(dd < dd0 || dd > dd1 || dd*Chunk+cs < so || dd*Chunk+ce > so+n)
+						miss = i;
+				}
+			}
+			for(dd = 0; dd < ndata; dd++) {
+				i = ddisk(r, s, dd);
+				if(r->m[i].state != Mok)
+					continue;
+				if(miss < 0 && dd >= dd0 && dd <= dd1 && dd*Chunk+cs >= so && dd*Chunk+ce <= so+n)
+					continue;
+				mstart(r, &q[nq++], i, 0, slot(r, i), w, mo);
+			}
+			if(miss >= 0) {
+				if(r->m[pd].state != Mok)
+					error(Etoomany);
+				mstart(r, &q[nq++], pd, 0, slot(r, pd), w, mo);
+			}
+		}
+		if(mwait(r, q, nq) == 0)
+			break;
+	}
+
+	if(rmw) {
+		/* xor out old data from the parity, in the xor slot, then xor in the new data */
+		ns = 0;
+		src[ns++] = slot(r, pd);
+		for(dd = dd0; dd <= dd1; dd++)
+			src[ns++] = slot(r, ddisk(r, s, dd));
+		xordma(slot(r, r->n), src, ns, w);
+	} else if(miss >= 0) {
+		ns = 0;
+		for(i = 0; i < r->n; i++)
+			if(i != miss)
+				src[ns++] = slot(r, i);
+		xordma(slot(r, miss), src, ns, w);
+	}
+
+	for(dd = dd0; dd <= dd1; dd++) {
+		pcs = dd*Chunk < so ? so-dd*Chunk : 0;
+		pce = (dd+1)*Chunk > so+n ? so+n-dd*Chunk : Chunk;
+		memmove(slot(r, ddisk(r, s, dd))+pcs-cs, buf+(dd*Chunk+pcs-so), pce-pcs);
+	}
+
+	ns = 0;
+	if(rmw) {
+		src[ns++] = slot(r, r->n);
+		for(dd = dd0; dd <= dd1; dd++)
+			src[ns++] = slot(r, ddisk(r, s, dd));
+		r->nrmw++;
+	} else {
+		for(dd = 0; dd < ndata; dd++)
+			src[ns++] = slot(r, ddisk(r, s, dd));
+		r->nrcw++;
+	}
+	xordma(slot(r, pd), src, ns, w);
+
+	nq = 0;
+	for(dd = dd0; dd <= dd1; dd++) {
+		i = ddisk(r, s, dd);
+		if(r->m[i].state != Mfailed)
+			mstart(r, &q[nq++], i, 1, slot(r, i), w, mo);
+	}
+	if(r->m[pd].state != Mfailed)
+		mstart(r, &q[nq++], pd, 1, slot(r, pd), w, mo);
+	mwait(r, q, nq);
+	redundant(r);
+	bitset(r, mo, w);
+
+	poperror();
+	free(q);
+}
+
+/* called with wl held */
+static long
+r5write(Raid *r, uchar *buf, long n, vlong off)
+{
+	vlong sw;
+	long h, l, so;
+
+	sw = (vlong)Chunk*(r->n-1);
+	for(h = 0; h < n; h += l) {
+		so = (off+h)%sw;
+		l = sw-so;
+		if(l > n-h)
+			l = n-h;
+		r5stripe(r, (off+h)/sw, so, buf+h, l);
+	}
+	return n;
+}
+
+static long
+raidio(void *a, int iswrite, void *buf, long n, vlong off)
+{
+	Store *d;
+	Raid *r;
+
+	d = a;
+	r = d->ctlr;
+	if(r->level == 0)
+		error(Enoarray);
+	if(off < 0 || off > d->size)
+		error(Ebadarg);
+	if(n > d->size-off)
+		n = d->size-off;
+	if(n <= 0)
+		return 0;
+
+	if(!iswrite) {
+		if(r->level == 1)
+			return r1read(r, buf, n, off);
+		return r5read(r, buf, n, off);
+	}
+
+	qlock(&r->wl);
+	if(waserror()) {
+		qunlock(&r->wl);
+		nexterror();
+	}
+	if(r->level == 1)
+		n = r1write(r, buf, n, off);
+	else
+		n = r5write(r, buf, n, off);
+	poperror();
+	qunlock(&r->wl);
+	return n;
+}
+
+/*
+ * bring members being resynced up to date for member offsets
+ * o..o+Chunk.  returns 0 when there are none.  called with wl held.
+ */
+static int
+syncchunk(Raid *r, vlong o)
+{
+	Mreq *q;
+	long n;
+	int i, nq;
+
+	if(nstate(r, Msync) == 0)
+		return 0;
+	n = Chunk;
+	if(n > r->msize-o)
+		n = r->msize-o;
+
+	q = mreqs(r->n);
+	if(waserror()) {
+		free(q);
+		nexterror();
+	}
+	if(r->level == 1) {
+		for(;;) {
+			for(i = 0; i < r->n; i++)
+				if(r->m[i].state == Mok)
+					break;
+			if(i == r->n)
+				error(Etoomany);
+			mstart(r, &q[0], i, 0, slot(r, r->n), n, o);
+			if(mwait(r, q, 1) == 0)
+				break;
+		}
+	} else {
+		/* the member slots are xor sources, rebuild into the xor slot */
+		for(i = 0; r->m[i].state != Msync; i++)
+			{}
+		r5rebuild(r, o/Chunk, i, 0, n, slot(r, r->n));
+	}
+	nq = 0;
+	for(i = 0; i < r->n; i++)
+		if(r->m[i].state == Msync)
+			mstart(r, &q[nq++], i, 1, slot(r, r->n), n, o);
+	mwait(r, q, nq);
+
+	poperror();
+	free(q);
+	return 1;
+}
+
+static void
+resyncproc(void *a)
+{
+	Raid *r;
+	vlong o;
+	long b;
+	int i, more;
+
+	r = a;
+	if(waserror()) {
+		print("%s: resync: %s\n", r->d->name, up->env->errstr);
+		r->syncing = 0;
+		return;
+	}
+	for(;;) {
+		qlock(&r->wl);
+		if(!r->restart)
+			break;
+		r->restart = 0;
+		qunlock(&r->wl);
+
+		more = 1;
+		for(b = 0; b < r->nbits && more; b++) {
+			if((r->bitmap[b/8] & 1<<(b%8)) == 0)
+				continue;
+			for(o = (vlong)b*Bmregion; o < (vlong)(b+1)*Bmregion && o < r->msize; o += Chunk) {
+				qlock(&r->wl);
+				if(waserror()) {
+					qunlock(&r->wl);
+					nexterror();
+				}
+				more = syncchunk(r, o);
+				r->syncpos = o+Chunk;
+				poperror();
+				qunlock(&r->wl);
+				if(!more)
+					break;
+			}
+			qlock(&r->wl);
+			if(more && nstate(r, Mfailed) == 0)
+				r->bitmap[b/8] &= ~(1<<(b%8));
+			qunlock(&r->wl);
+		}
+	}
+
+	/* wl still held, no member was added during the last pass */
+	for(i = 0; i < r->n; i++)
+		if(r->m[i].state == Msync) {
+			r->m[i].state = Mok;
+			print("%s: member %d (%s) in sync\n", r->d->name, i, r->m[i].name);
+		}
+	r->syncing = 0;
+	qunlock(&r->wl);
+	poperror();
+}
+
+/* called with wl held */
+static void
+resync(Raid *r)
+{
+	char name[KNAMELEN];
+
+	r->restart = 1;
+	if(r->syncing)
+		return;
+	r->syncing = 1;
+	r->syncpos = 0;
+	snprint(name, sizeof name, "%sresync", r->d->name);
+	kproc(name, resyncproc, r, 0);
+}
+
+static Store*
+member(Raid *r, char *name)
+{
+	Store *s;
+
+	s = blockstorelookup(name);
+	if(s == nil)
+		error("no such store");
+	if(s == r->d)
+		error("array cannot be its own member");
+	if(s->ready == 0)
+		error("store not ready");
+	return s;
+}
+
+/* "create raid1|raid5 store ... [sync]" */
+static void
+arraycreate(Raid *r, Cmdbuf *cb)
+{
+	Store *s;
+	vlong size;
+	uint alignmask;
+	int i, n, level, sync;
+
+	if(r->level != 0)
+		error("array already created");
+	if(strcmp(cb->f[1], "raid1") == 0)
+		level = 1;
+	else if(strcmp(cb->f[1], "raid5") == 0)
+		level = 5;
+	else
+		error("bad raid level");
+	n = cb->nf-2;
+	sync = n > 0 && strcmp(cb->f[cb->nf-1], "sync") == 0;
+	if(sync)
+		n--;
+	if(n < 2 || n > Maxmembers || level == 5 && n < 3)
+		error("bad number of members");
+
+	size = -1;
+	alignmask = 0;
+	for(i = 0; i < n; i++)
+		r->m[i].s = nil;
+	if(waserror()) {
+		for(i = 0; i < n; i++)
+			if(r->m[i].s != nil)
+				bsunclaim(r->m[i].s);
+		nexterror();
+	}
+	for(i = 0; i < n; i++) {
+		s = member(r, cb->f[2+i]);
+		bsclaim(s, r->d, 0);
+		if(size < 0 || s->size < size)
+			size = s->size;
+		alignmask |= s->alignmask;
+		r->m[i].s = s;
+		r->m[i].state = Mok;
+		r->m[i].nerrs = 0;
+		kstrcpy(r->m[i].name, s->name, sizeof r->m[i].name);
+	}
+	size -= size%Chunk;
+	if(size <= 0)
+		error("members too small");
+	if(alignmask >= Chunk)
+		error("member alignment too large");
+
+	r->sbase = malloc((n+1)*Chunk+CACHELINESIZE);
+	r->nbits = (size+Bmregion-1)/Bmregion;
+	r->bitmap = malloc((r->nbits+7)/8);
+	if(r->sbase == nil || r->bitmap == nil) {
+		free(r->sbase);
+		free(r->bitmap);
+		r->sbase = nil;
+		r->bitmap = nil;
+		error(Enomem);
+	}
+	poperror();
+	r->sbuf = (uchar*)(((ulong)r->sbase+CACHELINESIZE-1)&~(CACHELINESIZE-1));
+	r->n = n;
+	r->msize = size;
+	r->d->alignmask = alignmask;
+	r->level = level;
+
+	memset(r->bitmap, 0, (r->nbits+7)/8);
+	if(sync) {
+		/* the members being synced are written but not read, until resyncproc is done */
+		if(level == 1)
+			for(i = 1; i < n; i++)
+				r->m[i].state = Msync;
+		else
+			r->m[n-1].state = Msync;
+		memset(r->bitmap, 0xff, (r->nbits+7)/8);
+		resync(r);
+	}
+}
+
+/* "add i store", replace failed member i */
+static void
+arrayadd(Raid *r, Cmdbuf *cb)
+{
+	Member *m;
+	Store *s;
+	int i;
+
+	if(r->level == 0)
+		error(Enoarray);
+	i = atoi(cb->f[1]);
+	if(i < 0 || i >= r->n)
+		error(Ebadarg);
+	m = &r->m[i];
+	if(m->state != Mfailed)
+		error("member not failed");
+	s = member(r, cb->f[2]);
+	if(s->size < r->msize)
+		error("store too small");
+	if(s->alignmask & ~r->d->alignmask)
+		error("store has larger alignment");
+	for(i = 0; i < r->n; i++)
+		if(r->m[i].s == s && &r->m[i] != m)
+			error("store already a member");
+	/* a failed member stays claimed, it is likely added back */
+	if(s != m->s) {
+		bsclaim(s, r->d, 0);
+		bsunclaim(m->s);
+	}
+	if(strcmp(m->name, s->name) != 0) {
+		/* new store, nothing is in sync */
+		memset(r->bitmap, 0xff, (r->nbits+7)/8);
+		kstrcpy(m->name, s->name, sizeof m->name);
+	}
+	m->s = s;
+	m->state = Msync;
+	resync(r);
+}
+
+static void
+raidinit(Store*)
+{
+}
+
+static void
+raiddevinit(Store *d)
+{
+	Raid *r;
+
+	r = d->ctlr;
+	if(r->level == 0)
+		error(Enoarray);
+	if(r->level == 1)
+		d->size = r->msize;
+	else
+		d->size = r->msize*(r->n-1);
+	free(d->descr);
+	d->descr = smprint("raid%d, %d members, chunk %d", r->level, r->n, Chunk);
+}
+
+static long
+raidrctl(Store *d, void *a, long n, vlong off)
+{
+	Raid *r;
+	Member *m;
+	char *buf, *p, *e;
+	long b, nset;
+	int i;
+
+	r = d->ctlr;
+	buf = smalloc(READSTR);
+	if(waserror()) {
+		free(buf);
+		nexterror();
+	}
+	p = buf;
+	e = buf+READSTR;
+	if(r->level == 0)
+		p = seprint(p, e, "not created\n");
+	else {
+		nset = 0;
+		for(b = 0; b < r->nbits; b++)
+			if(r->bitmap[b/8] & 1<<(b%8))
+				nset++;
+		p = seprint(p, e, "raid%d chunk %d membersize %lld\n", r->level, Chunk, r->msize);
+		for(i = 0; i < r->n; i++) {
+			m = &r->m[i];
+			p = seprint(p, e, "member %d %s %s errors %lud\n", i, m->name, mstates[m->state], m->nerrs);
+		}
+		p = seprint(p, e, "bitmap %ld/%ld regions of %d bytes\n", nset, r->nbits, Bmregion);
+		if(r->syncing)
+			p = seprint(p, e, "resync %lld/%lld\n", r->syncpos, r->msize);
+		p = seprint(p, e, "degraded reads %lud\n", r->ndegraded);
+		if(r->level == 5)
+			p = seprint(p, e, "stripe writes rmw %lud rcw %lud\n", r->nrmw, r->nrcw);
+	}
+	USED(p);
+	n = readstr(off, a, n, buf);
+	poperror();
+	free(buf);
+	return n;
+}
+
+enum {
+	CMcreate, CMfail, CMadd,
+};
+static Cmdtab raidctl[] = {
+	CMcreate,	"create",	0,
+	CMfail,		"fail",		2,
+	CMadd,		"add",		3,
+};
+
+static long
+raidwctl(Store *d, void *a, long n)
+{
+	Raid *r;
+	Cmdbuf *cb;
+	Cmdtab *ct;
+	int i, create0;
+
+	r = d->ctlr;
+	cb = parsecmd(a, n);
+	qlock(&r->wl);
+	if(waserror()) {
+		qunlock(&r->wl);
+		free(cb);
+		nexterror();
+	}
+
+	create0 = 0;
+	ct = lookupcmd(cb, raidctl, nelem(raidctl));
+	switch(ct->index) {
+	case CMcreate:
+		if(cb->nf < 2)
+			error(Ebadarg);
+		arraycreate(r, cb);
+		create0 = 1;
+		break;
+	case CMfail:
+		if(r->level == 0)
+			error(Enoarray);
+		i = atoi(cb->f[1]);
+		if(i < 0 || i >= r->n)
+			error(Ebadarg);
+		mfail(r, i, "failed by ctl");
+		break;
+	case CMadd:
+		arrayadd(r, cb);
+		break;
+	}
+
+	poperror();
+	qunlock(&r->wl);
+	free(cb);
+
+	/* read the partitions, in a new process since d is locked by our caller */
+	if(create0)
+		blockstoreready(d);
+	return n;
+}
+
+void
+raidlink(void)
+{
+	Store *d;
+	int i;
+
+	for(i = 0; i < Narray; i++) {
+		d = &arrays[i];
+		raids[i].d = d;
+		d->ctlr = &raids[i];
+		d->num = Firstnum+i;
+		strcpy(d->devtype, "raid");
+		d->init = raidinit;
+		d->devinit = raiddevinit;
+		d->rctl = raidrctl;
+		d->wctl = raidwctl;
+		d->io = raidio;
+		blockstoreadd(d);
+	}
+}